@@ -7,6 +7,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -17,6 +19,42 @@
 
 static int imagesize = 0;
 
+/* every CHAIN_SKIP'th cluster of a chain is kept in its skip index, so
+   finding cluster n of a chain costs at most CHAIN_SKIP FAT lookups */
+#define CHAIN_SKIP 16
+
+struct chain_index {
+    uint16_t start;             /* first cluster of the chain */
+    uint32_t nmarks;
+    uint16_t *marks;            /* marks[i] is cluster i*CHAIN_SKIP of the chain */
+    struct chain_index *next;
+};
+
+static struct chain_index *chain_indexes = NULL;
+
+/* the free space map: every run of free clusters on the disk, kept
+   sorted both by where it starts and by (length, start), so we can
+   find neighbours to merge with and the best fit by binary search.
+   It is built from the FAT the first time it's needed, and from then
+   on cluster allocation and freeing should go through freemap_*() so
+   it stays in step with the FAT */
+static struct extent *free_by_start = NULL;
+static struct extent *free_by_len = NULL;
+static int nfree_runs = 0;
+static int free_runs_alloced = 0;
+static int freemap_built = FALSE;
+
+/* insertion hints for create_dirent: every slot in the directory
+   before the hinted one is known to be in use */
+struct dir_hint {
+    uint16_t dir;               /* first cluster of the directory, 0 for root */
+    uint16_t cluster;           /* the cluster the hinted slot is in */
+    int slot;                   /* the hinted slot's index in that cluster */
+    struct dir_hint *next;
+};
+
+static struct dir_hint *dir_hints = NULL;
+
 /* memory map the FAT-12  disk image file */
 uint8_t *mmap_file(char *filename, int *fd)
 {
@@ -76,7 +114,19 @@ uint8_t *mmap_file(char *filename, int *fd)
 
 void unmmap_file(uint8_t *image, int *fd)
 {
-    munmap(image, imagesize);
+    struct stat statbuf;
+
+    chain_index_flush();
+    free(free_by_start);
+    free(free_by_len);
+    free_by_start = free_by_len = NULL;
+    nfree_runs = free_runs_alloced = 0;
+    freemap_built = FALSE;
+    while (dir_hints != NULL)
+    	dir_hint_forget(dir_hints->dir);
+    /* more than one image may be mapped, so ask this one its size */
+    if (fstat(*fd, &statbuf) == 0)
+    	munmap(image, statbuf.st_size);
     close(*fd);
 }
 
@@ -181,12 +231,29 @@ uint16_t get_fat_entry(uint16_t clusternum, uint8_t *image_buf, struct bpb33* bp
 }
 
 
-/* set_fat_entry sets the value of the FAT entry for clusternum to value. */
+/* fat_mirror copies len bytes of FAT 1 at offset into every other
+   copy of the FAT, so that they all stay the same */
+static void fat_mirror(uint32_t offset, uint32_t len,
+		       uint8_t *image_buf, struct bpb33* bpb) {
+    uint32_t fat_size = bpb->bpbFATsecs * bpb->bpbBytesPerSec;
+    int i;
+
+    for (i = 1; i < bpb->bpbFATs; i++)
+    	memcpy(image_buf + offset + i * fat_size, image_buf + offset, len);
+}
+
+
+/* set_fat_entry sets the value of the FAT entry for clusternum to
+   value, in every copy of the FAT. */
 void set_fat_entry(uint16_t clusternum, uint16_t value,
 		   uint8_t *image_buf, struct bpb33* bpb) {
     uint32_t offset;
     uint8_t *p1, *p2;
 
+    /* any cached skip index may now describe the wrong chain */
+    if (chain_indexes != NULL)
+    	chain_index_flush();
+
     /* this involves some really ugly bit shifting.  This probably
        only works on a little-endian machine. */
     offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust
@@ -206,18 +273,91 @@ void set_fat_entry(uint16_t clusternum, uint16_t value,
         	*p2 = (uint8_t)(0xff & (value >> 4));
     	break;
     }
+    fat_mirror(p1 - image_buf, 2, image_buf, bpb);
+}
+
+
+/* cluster_count returns one more than the highest cluster number that
+   has room in the data area of the disk */
+uint16_t cluster_count(struct bpb33 *bpb)
+{
+    uint32_t data_start = bpb->bpbResSectors + bpb->bpbFATs * bpb->bpbFATsecs
+    	+ (bpb->bpbRootDirEnts * sizeof(struct direntry)) / bpb->bpbBytesPerSec;
+    return ((bpb->bpbSectors - data_start) / bpb->bpbSecPerClust + CLUST_FIRST) & FAT12_MASK;
 }
 
 
 int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
 {
-    uint16_t max_cluster = (bpb->bpbSectors / bpb->bpbSecPerClust) & FAT12_MASK;
+    uint16_t max_cluster = cluster_count(bpb);
     if (cluster >= (FAT12_MASK & CLUST_FIRST) && cluster <= (FAT12_MASK & CLUST_LAST) && cluster < max_cluster)
         return TRUE;
     return FALSE;
 }
 
 
+/* fat_offset returns where in the image the FAT entry for cluster
+   starts (see get_fat_entry) */
+static uint32_t fat_offset(uint16_t cluster, struct bpb33* bpb) {
+    return bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust
+    	+ (3 * (cluster/2));
+}
+
+
+/* set_fat_run links the len clusters starting at start into a chain,
+   and points the last of them at next.  Pairs of entries that share
+   their three bytes of the FAT are written whole, rather than with a
+   read-modify-write per entry */
+void set_fat_run(uint16_t start, uint16_t len, uint16_t next,
+		 uint8_t *image_buf, struct bpb33* bpb) {
+    uint16_t c = start, end = start + len, first;
+
+    if (chain_indexes != NULL)
+    	chain_index_flush();
+
+    /* an odd first cluster shares its bytes with one outside the run */
+    if (c % 2 == 1 && c + 1 < end) {
+    	set_fat_entry(c, c + 1, image_buf, bpb);
+    	c++;
+    }
+    for (first = c; c + 2 < end; c += 2) {
+    	uint8_t *p = image_buf + fat_offset(c, bpb);
+    	uint16_t v0 = c + 1, v1 = c + 2;
+    	p[0] = (uint8_t)(0xff & v0);
+    	p[1] = (uint8_t)((0x0f & (v0 >> 8)) | ((0x0f & v1) << 4));
+    	p[2] = (uint8_t)(0xff & (v1 >> 4));
+    }
+    if (c > first)
+    	fat_mirror(fat_offset(first, bpb), fat_offset(c, bpb) - fat_offset(first, bpb),
+    		   image_buf, bpb);
+    for ( ; c + 1 < end; c++)
+    	set_fat_entry(c, c + 1, image_buf, bpb);
+    set_fat_entry(end - 1, next, image_buf, bpb);
+}
+
+
+/* clear_fat_run marks the len clusters starting at start free.  The
+   bytes holding whole pairs of entries are just zeroed */
+void clear_fat_run(uint16_t start, uint16_t len,
+		   uint8_t *image_buf, struct bpb33* bpb) {
+    uint16_t c = start, end = start + len;
+
+    if (chain_indexes != NULL)
+    	chain_index_flush();
+
+    if (c % 2 == 1 && c < end)
+    	set_fat_entry(c++, CLUST_FREE, image_buf, bpb);
+    if (c + 1 < end) {
+    	uint16_t pairs = (end - c) / 2;
+    	memset(image_buf + fat_offset(c, bpb), 0, 3 * pairs);
+    	fat_mirror(fat_offset(c, bpb), 3 * pairs, image_buf, bpb);
+    	c += 2 * pairs;
+    }
+    if (c < end)
+    	set_fat_entry(c, CLUST_FREE, image_buf, bpb);
+}
+
+
 /* is_end_of_file returns true if the FAT entry for cluster indicates
    this is the last cluster in a file */
 int is_end_of_file(uint16_t cluster)
@@ -251,3 +391,818 @@ uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb
     }
     return p;
 }
+
+
+/* chain_extent returns the number of physically contiguous clusters
+   at the start of the chain beginning with cluster, and stores the FAT
+   entry of the last cluster in that run (the next cluster in the
+   chain, or an EOF/bad/free marker) in *next */
+uint16_t chain_extent(uint16_t cluster, uint16_t *next,
+		      uint8_t *image_buf, struct bpb33* bpb) {
+    uint16_t len = 1;
+    uint16_t fat = get_fat_entry(cluster, image_buf, bpb);
+
+    while (fat == cluster + len && is_valid_cluster(fat, bpb)) {
+    	len++;
+    	fat = get_fat_entry(fat, image_buf, bpb);
+    }
+    *next = fat;
+    return len;
+}
+
+
+/* chain_walk_init sets w up to walk the chain starting at start.  No
+   walk can hand out more clusters than the disk has, and each cluster
+   handed out is noted in w's bitmap, so a chain that loops back on
+   itself is caught the first time it does, at the cluster where the
+   loop closes */
+void chain_walk_init(struct chain_walk *w, uint16_t start,
+		     uint8_t *image_buf, struct bpb33* bpb) {
+    memset(w->visited, 0, sizeof(w->visited));
+    w->cluster = start;
+    w->steps = 0;
+    w->limit = cluster_count(bpb);
+    w->loop = CLUST_FREE;
+    w->status = CHAIN_OK;
+    w->image_buf = image_buf;
+    w->bpb = bpb;
+}
+
+
+/* chain_walk_ended returns TRUE if the walk has nowhere left to go,
+   and sets w->status to say why */
+static int chain_walk_ended(struct chain_walk *w) {
+    uint16_t c = w->cluster;
+
+    if (w->status != CHAIN_OK)
+    	return TRUE;
+    if (is_valid_cluster(c, w->bpb))
+    	return FALSE;
+    if (is_end_of_file(c) || (c == CLUST_FREE && w->steps == 0))
+    	w->status = CHAIN_END;
+    else
+    	w->status = CHAIN_BROKEN;
+    return TRUE;
+}
+
+
+/* chain_walk_mark notes the len clusters from w->cluster as visited,
+   or returns FALSE if one of them already was, or there are more than
+   the disk has room for */
+static int chain_walk_mark(struct chain_walk *w, uint16_t len) {
+    uint16_t i;
+
+    for (i = 0; i < len; i++) {
+    	uint16_t c = w->cluster + i;
+    	if ((w->visited[c / 8] & (1 << (c % 8))) || w->steps >= w->limit) {
+    	    w->status = CHAIN_LOOP;
+    	    w->loop = c;
+    	    return FALSE;
+    	}
+    	w->visited[c / 8] |= 1 << (c % 8);
+    	w->steps++;
+    }
+    return TRUE;
+}
+
+
+/* chain_walk_next stores the next cluster of the walk in *cluster and
+   returns TRUE, or returns FALSE once the chain has ended, broken off
+   or looped (see w->status) */
+int chain_walk_next(struct chain_walk *w, uint16_t *cluster) {
+    if (chain_walk_ended(w) || !chain_walk_mark(w, 1))
+    	return FALSE;
+    *cluster = w->cluster;
+    w->cluster = get_fat_entry(w->cluster, w->image_buf, w->bpb);
+    return TRUE;
+}
+
+
+/* chain_walk_extent is chain_walk_next a contiguous run at a time: the
+   run's first cluster goes in *start and its length in *len */
+int chain_walk_extent(struct chain_walk *w, uint16_t *start, uint16_t *len) {
+    uint16_t next, n;
+
+    if (chain_walk_ended(w))
+    	return FALSE;
+    n = chain_extent(w->cluster, &next, w->image_buf, w->bpb);
+    if (!chain_walk_mark(w, n))
+    	return FALSE;
+    *start = w->cluster;
+    *len = n;
+    w->cluster = next;
+    return TRUE;
+}
+
+
+/* chain_walk_check gives up on the image if the walk found a loop,
+   saying whose chain it was in what */
+void chain_walk_check(struct chain_walk *w, char *what) {
+    if (w->status != CHAIN_LOOP)
+    	return;
+    fprintf(stderr, "%s: cluster chain loops back to cluster %u after %u clusters\n",
+	    what, w->loop, w->steps);
+    exit(1);
+}
+
+
+/* dir_trail_enter notes that a walk is going into the directory
+   starting at cluster, named what (or NULL if the caller has no name
+   for it).  If that directory is already on the way down, or the tree
+   goes deeper than any real one can, the image has a directory inside
+   itself: like chain_walk_check it says where, and gives up on the
+   image rather than go round the loop.  Every dir_trail_enter is
+   matched by a dir_trail_leave on the way back up */
+void dir_trail_enter(struct dir_trail *t, uint16_t cluster, char *what) {
+    int i;
+
+    for (i = 0; i < t->depth && t->clusters[i] != cluster; i++)
+    	;
+    if (i < t->depth || t->depth > MAXDIRDEPTH) {
+    	if (what != NULL)
+    	    fprintf(stderr, "%s: directory at cluster %u is nested inside itself\n",
+		    what, cluster);
+    	else
+    	    fprintf(stderr, "Directory at cluster %u is nested inside itself\n", cluster);
+    	exit(1);
+    }
+    t->clusters[t->depth++] = cluster;
+}
+
+void dir_trail_leave(struct dir_trail *t) {
+    t->depth--;
+}
+
+
+/* build_chain_index walks the chain from start once, recording every
+   CHAIN_SKIP'th cluster.  A looping chain is indexed up to where the
+   loop closes */
+static struct chain_index *build_chain_index(uint16_t start,
+					     uint8_t *image_buf, struct bpb33* bpb) {
+    uint32_t alloced = 16, n = 0;
+    uint16_t cluster;
+    struct chain_index *idx = malloc(sizeof(struct chain_index));
+    struct chain_walk w;
+
+    idx->start = start;
+    idx->marks = malloc(alloced * sizeof(uint16_t));
+    chain_walk_init(&w, start, image_buf, bpb);
+    while (chain_walk_next(&w, &cluster)) {
+    	if (n % CHAIN_SKIP == 0) {
+    	    if (n / CHAIN_SKIP == alloced) {
+    		alloced *= 2;
+    		idx->marks = realloc(idx->marks, alloced * sizeof(uint16_t));
+    	    }
+    	    idx->marks[n / CHAIN_SKIP] = cluster;
+    	}
+    	n++;
+    }
+    idx->nmarks = (n + CHAIN_SKIP - 1) / CHAIN_SKIP;
+    idx->next = chain_indexes;
+    chain_indexes = idx;
+    return idx;
+}
+
+
+/* chain_seek returns cluster number n (counting from 0) of the chain
+   starting at start, or CLUST_FREE if the chain is shorter than that.
+   The chain's skip index is built on first use and kept until the FAT
+   is modified or the image is unmapped.  Building it walks the whole
+   chain, so it only pays for itself over many lookups in the same
+   chain; for one, use chain_nth */
+uint16_t chain_seek(uint16_t start, uint32_t n,
+		    uint8_t *image_buf, struct bpb33* bpb) {
+    struct chain_index *idx;
+    uint16_t cluster;
+    uint32_t i;
+
+    for (idx = chain_indexes; idx != NULL; idx = idx->next)
+    	if (idx->start == start)
+    	    break;
+    if (idx == NULL)
+    	idx = build_chain_index(start, image_buf, bpb);
+
+    if (n / CHAIN_SKIP >= idx->nmarks)
+    	return CLUST_FREE;
+    cluster = idx->marks[n / CHAIN_SKIP];
+    for (i = 0; i < n % CHAIN_SKIP; i++) {
+    	cluster = get_fat_entry(cluster, image_buf, bpb);
+    	if (!is_valid_cluster(cluster, bpb))
+    	    return CLUST_FREE;
+    }
+    return cluster;
+}
+
+
+/* chain_nth returns cluster number n of the chain starting at start,
+   or CLUST_FREE if the chain is shorter than that, following it only
+   as far as it has to, a run at a time */
+uint16_t chain_nth(uint16_t start, uint32_t n,
+		   uint8_t *image_buf, struct bpb33* bpb) {
+    struct chain_walk w;
+    uint16_t cluster, len;
+
+    chain_walk_init(&w, start, image_buf, bpb);
+    while (chain_walk_extent(&w, &cluster, &len)) {
+    	if (n < len)
+    	    return cluster + n;
+    	n -= len;
+    }
+    return CLUST_FREE;
+}
+
+
+/* chain_index_flush throws away all the cached skip indexes */
+void chain_index_flush(void) {
+    while (chain_indexes != NULL) {
+    	struct chain_index *idx = chain_indexes;
+    	chain_indexes = idx->next;
+    	free(idx->marks);
+    	free(idx);
+    }
+}
+
+
+/* the free space map.  The orderings used by the two indexes */
+static int start_cmp(const struct extent *a, const struct extent *b) {
+    return (int)a->start - (int)b->start;
+}
+
+static int len_cmp(const struct extent *a, const struct extent *b) {
+    if (a->len != b->len)
+    	return (int)a->len - (int)b->len;
+    return (int)a->start - (int)b->start;
+}
+
+
+/* index_find returns the position of the first extent in index that
+   doesn't order before key */
+static int index_find(struct extent *index, struct extent *key,
+		      int (*cmp)(const struct extent *, const struct extent *)) {
+    int lo = 0, hi = nfree_runs;
+    while (lo < hi) {
+    	int mid = (lo + hi) / 2;
+    	if (cmp(&index[mid], key) < 0)
+    	    lo = mid + 1;
+    	else
+    	    hi = mid;
+    }
+    return lo;
+}
+
+
+static void freemap_insert(uint16_t start, uint16_t len) {
+    struct extent e;
+    int i;
+
+    if (nfree_runs == free_runs_alloced) {
+    	free_runs_alloced = free_runs_alloced ? free_runs_alloced * 2 : 64;
+    	free_by_start = realloc(free_by_start, free_runs_alloced * sizeof(struct extent));
+    	free_by_len = realloc(free_by_len, free_runs_alloced * sizeof(struct extent));
+    }
+    e.start = start;
+    e.len = len;
+
+    i = index_find(free_by_start, &e, start_cmp);
+    memmove(&free_by_start[i + 1], &free_by_start[i], (nfree_runs - i) * sizeof(struct extent));
+    free_by_start[i] = e;
+
+    i = index_find(free_by_len, &e, len_cmp);
+    memmove(&free_by_len[i + 1], &free_by_len[i], (nfree_runs - i) * sizeof(struct extent));
+    free_by_len[i] = e;
+
+    nfree_runs++;
+}
+
+
+static void freemap_remove(struct extent e) {
+    int i;
+
+    nfree_runs--;
+    i = index_find(free_by_start, &e, start_cmp);
+    memmove(&free_by_start[i], &free_by_start[i + 1], (nfree_runs - i) * sizeof(struct extent));
+    i = index_find(free_by_len, &e, len_cmp);
+    memmove(&free_by_len[i], &free_by_len[i + 1], (nfree_runs - i) * sizeof(struct extent));
+}
+
+
+/* freemap_build collects the free runs with one pass over the FAT */
+static void freemap_build(uint8_t *image_buf, struct bpb33* bpb) {
+    uint16_t max_cluster = cluster_count(bpb);
+    uint16_t c = CLUST_FIRST;
+
+    nfree_runs = 0;
+    while (c < max_cluster) {
+    	uint16_t start;
+    	if (get_fat_entry(c, image_buf, bpb) != CLUST_FREE) {
+    	    c++;
+    	    continue;
+    	}
+    	start = c;
+    	while (c < max_cluster && get_fat_entry(c, image_buf, bpb) == CLUST_FREE)
+    	    c++;
+    	freemap_insert(start, c - start);
+    }
+    freemap_built = TRUE;
+}
+
+
+/* take_front hands out the first n clusters of the free run e */
+static void take_front(struct extent e, uint16_t n) {
+    freemap_remove(e);
+    if (e.len > n)
+    	freemap_insert(e.start + n, e.len - n);
+}
+
+
+/* freemap_alloc finds n contiguous free clusters, placed according to
+   policy (FIT_BEST or FIT_FIRST), and takes them out of the free
+   space map.  It returns FALSE if there is no free run that big.  The
+   FAT itself isn't touched; the caller links the clusters up */
+int freemap_alloc(uint16_t n, int policy, struct extent *out,
+		  uint8_t *image_buf, struct bpb33* bpb) {
+    struct extent key;
+    int i;
+
+    if (!freemap_built)
+    	freemap_build(image_buf, bpb);
+
+    if (policy == FIT_FIRST) {
+    	for (i = 0; i < nfree_runs; i++)
+    	    if (free_by_start[i].len >= n)
+    		break;
+    	if (i == nfree_runs)
+    	    return FALSE;
+    	*out = free_by_start[i];
+    }
+    else {
+    	key.start = 0;
+    	key.len = n;
+    	i = index_find(free_by_len, &key, len_cmp);
+    	if (i == nfree_runs)
+    	    return FALSE;
+    	*out = free_by_len[i];
+    }
+
+    take_front(*out, n);
+    out->len = n;
+    return TRUE;
+}
+
+
+static int runs_by_start(const void *a, const void *b) {
+    return start_cmp(a, b);
+}
+
+
+/* freemap_alloc_chain finds room for n clusters: a single best-fit run
+   if there is one big enough, otherwise as few runs as possible,
+   biggest first.  The runs come back in *runs in disk order, and the
+   number of them is returned; 0 if there isn't enough free space, in
+   which case nothing is allocated */
+int freemap_alloc_chain(uint32_t n, struct extent **runs,
+			uint8_t *image_buf, struct bpb33* bpb) {
+    uint32_t got = 0;
+    int nruns = 0;
+
+    if (!freemap_built)
+    	freemap_build(image_buf, bpb);
+
+    *runs = NULL;
+    if (n == 0 || n > freemap_free_clusters(image_buf, bpb))
+    	return 0;
+
+    *runs = malloc(sizeof(struct extent) * (nfree_runs + 1));
+    if (n <= FAT12_MASK && freemap_alloc(n, FIT_BEST, *runs, image_buf, bpb))
+    	return 1;
+
+    while (got < n) {
+    	uint32_t want = n - got;
+    	struct extent e;
+
+    	/* the biggest run, or the best fit for what's left if that
+    	   finishes the job */
+    	if (want > free_by_len[nfree_runs - 1].len
+    	    || !freemap_alloc(want, FIT_BEST, &e, image_buf, bpb)) {
+    	    e = free_by_len[nfree_runs - 1];
+    	    take_front(e, e.len);
+    	}
+    	(*runs)[nruns++] = e;
+    	got += e.len;
+    }
+
+    qsort(*runs, nruns, sizeof(struct extent), runs_by_start);
+    return nruns;
+}
+
+
+/* freemap_reserve takes cluster out of the free space map, if it's
+   in it, without handing it out: for a free cluster that's about to be
+   marked bad */
+void freemap_reserve(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb) {
+    struct extent key, e;
+    int i;
+
+    if (!freemap_built)
+    	freemap_build(image_buf, bpb);
+
+    key.start = cluster + 1;
+    key.len = 0;
+    i = index_find(free_by_start, &key, start_cmp);
+    if (i == 0)
+    	return;
+    e = free_by_start[i - 1];
+    if (cluster >= e.start + e.len)
+    	return;
+
+    freemap_remove(e);
+    if (cluster > e.start)
+    	freemap_insert(e.start, cluster - e.start);
+    if (cluster + 1 < e.start + e.len)
+    	freemap_insert(cluster + 1, e.start + e.len - cluster - 1);
+}
+
+
+/* freemap_release frees the len clusters starting at start: they are
+   merged with any free neighbours in the map, and cleared in the FAT */
+void freemap_release(uint16_t start, uint16_t len,
+		     uint8_t *image_buf, struct bpb33* bpb) {
+    struct extent key;
+    int i;
+
+    if (len == 0)
+    	return;
+    if (!freemap_built)
+    	freemap_build(image_buf, bpb);
+
+    clear_fat_run(start, len, image_buf, bpb);
+
+    key.start = start;
+    key.len = len;
+    i = index_find(free_by_start, &key, start_cmp);
+    if (i < nfree_runs && free_by_start[i].start == start + len) {
+    	struct extent next = free_by_start[i];
+    	freemap_remove(next);
+    	len += next.len;
+    }
+    if (i > 0 && free_by_start[i - 1].start + free_by_start[i - 1].len == start) {
+    	struct extent prev = free_by_start[i - 1];
+    	freemap_remove(prev);
+    	start = prev.start;
+    	len += prev.len;
+    }
+    freemap_insert(start, len);
+}
+
+
+/* freemap_free_clusters returns the number of free clusters */
+uint32_t freemap_free_clusters(uint8_t *image_buf, struct bpb33* bpb) {
+    uint32_t total = 0;
+    int i;
+
+    if (!freemap_built)
+    	freemap_build(image_buf, bpb);
+    for (i = 0; i < nfree_runs; i++)
+    	total += free_by_start[i].len;
+    return total;
+}
+
+
+/* free_chain gives back every cluster of the chain starting at
+   cluster, a contiguous run at a time, and returns how many it freed.
+   It stops at the first entry that isn't a valid cluster, or where a
+   looping chain comes back to a cluster it has already freed */
+uint32_t free_chain(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb) {
+    uint32_t freed = 0;
+    uint16_t start, len;
+    struct chain_walk w;
+
+    chain_walk_init(&w, cluster, image_buf, bpb);
+    while (chain_walk_extent(&w, &start, &len)) {
+    	freemap_release(start, len, image_buf, bpb);
+    	freed += len;
+    }
+    return freed;
+}
+
+
+/* write the values into a directory entry */
+void write_dirent(struct direntry *dirent, char *filename, uint8_t attr,
+		  uint16_t start_cluster, uint32_t size)
+{
+    char *p, *p2;
+    char *uppername;
+    int len, i;
+
+    /* clean out anything old that used to be here */
+    memset(dirent, 0, sizeof(struct direntry));
+
+    /* extract just the filename part */
+    uppername = strdup(filename);
+    p2 = uppername;
+    for (i = 0; i < (int)strlen(filename); i++) {
+    	if (p2[i] == '/' || p2[i] == '\\')
+    	    uppername = p2 + i + 1;
+    }
+
+    /* convert filename to upper case */
+    for (i = 0; i < (int)strlen(uppername); i++)
+    	uppername[i] = toupper(uppername[i]);
+
+    /* set the file name and extension */
+    memset(dirent->deName, ' ', 8);
+    p = strchr(uppername, '.');
+    if ((attr & ATTR_DIRECTORY) != 0)
+    	memset(dirent->deExtension, ' ', 3);
+    else
+    	memcpy(dirent->deExtension, "___", 3);
+    if (p == NULL) {
+    	if ((attr & ATTR_DIRECTORY) == 0)
+    	    fprintf(stderr, "No filename extension given - defaulting to .___\n");
+    }
+    else {
+    	*p = '\0';
+    	p++;
+    	len = strlen(p);
+    	if (len > 3) len = 3;
+    	memset(dirent->deExtension, ' ', 3);
+    	memcpy(dirent->deExtension, p, len);
+    }
+
+    if (strlen(uppername)>8)
+        uppername[8]='\0';
+    memcpy(dirent->deName, uppername, strlen(uppername));
+    free(p2);
+
+    /* set the attributes and file size */
+    dirent->deAttributes = attr;
+    putushort(dirent->deStartCluster, start_cluster);
+    putulong(dirent->deFileSize, size);
+
+    /* could also set time and date here if we really
+       cared... */
+}
+
+
+/* dir_hint_forget drops the insertion hint for the directory starting
+   at dir.  Anything that frees a slot in a directory, or frees the
+   directory itself, must call it */
+void dir_hint_forget(uint16_t dir) {
+    struct dir_hint **hp;
+    for (hp = &dir_hints; *hp != NULL; hp = &(*hp)->next) {
+    	if ((*hp)->dir == dir) {
+    	    struct dir_hint *h = *hp;
+    	    *hp = h->next;
+    	    free(h);
+    	    return;
+    	}
+    }
+}
+
+
+/* create_dirent finds a free slot in the directory starting at dir
+   (0 for the root), and writes the directory entry there.  The search
+   starts from where the last one for this directory left off.  A
+   full subdirectory is grown by a zeroed cluster; a full root
+   directory can't be, so NULL is returned.  NULL also comes back if
+   there's no room left on the disk, or the directory's chain is
+   broken */
+struct direntry *create_dirent(uint16_t dir, char *filename, uint8_t attr,
+			       uint16_t start_cluster, uint32_t size,
+			       uint8_t *image_buf, struct bpb33* bpb) {
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t max_clusters = cluster_count(bpb), steps = 0;
+    int per_cluster = dir == MSDOSFSROOT ? bpb->bpbRootDirEnts
+    	: clust_size / sizeof(struct direntry);
+    struct dir_hint *hint;
+    uint16_t cluster;
+    int slot;
+
+    for (hint = dir_hints; hint != NULL; hint = hint->next)
+    	if (hint->dir == dir)
+    	    break;
+    if (hint == NULL) {
+    	hint = malloc(sizeof(struct dir_hint));
+    	hint->dir = hint->cluster = dir;
+    	hint->slot = 0;
+    	hint->next = dir_hints;
+    	dir_hints = hint;
+    }
+    cluster = hint->cluster;
+    slot = hint->slot;
+
+    while (1) {
+    	struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb) + slot;
+    	struct extent e;
+    	uint16_t next;
+
+    	for ( ; slot < per_cluster; slot++, dirent++) {
+    	    if (dirent->deName[0] == SLOT_EMPTY) {
+    		/* we found an empty slot at the end of the directory */
+    		write_dirent(dirent, filename, attr, start_cluster, size);
+
+    		/* make sure the next dirent is set to be empty, just in
+    		   case it wasn't before */
+    		if (slot + 1 < per_cluster)
+    		    memset((uint8_t*)(dirent + 1), 0, sizeof(struct direntry));
+    		break;
+    	    }
+    	    if (dirent->deName[0] == SLOT_DELETED) {
+    		/* we found a deleted entry - we can just overwrite it */
+    		write_dirent(dirent, filename, attr, start_cluster, size);
+    		break;
+    	    }
+    	}
+    	hint->cluster = cluster;
+    	hint->slot = slot + 1;
+    	if (slot < per_cluster)
+    	    return dirent;
+
+    	/* this cluster is full; move on to the next one */
+    	if (dir == MSDOSFSROOT)
+    	    return NULL;        // the root directory can't grow
+    	next = get_fat_entry(cluster, image_buf, bpb);
+    	if (is_end_of_file(next)) {
+    	    if (!freemap_alloc(1, FIT_BEST, &e, image_buf, bpb))
+    		return NULL;
+    	    memset(cluster_to_addr(e.start, image_buf, bpb), 0, clust_size);
+    	    set_fat_entry(e.start, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+    	    set_fat_entry(cluster, e.start, image_buf, bpb);
+    	    next = e.start;
+    	}
+    	if (!is_valid_cluster(next, bpb) || ++steps > max_clusters)
+    	    return NULL;
+    	cluster = next;
+    	slot = 0;
+    }
+}
+
+
+/* dirent_name puts the name of a directory entry in fullname, as
+   NAME.EXT, or just NAME if there's no extension */
+void dirent_name(char *fullname, struct direntry *dirent) {
+    int i, n = 0;
+
+    for (i = 0; i < 8 && dirent->deName[i] != ' '; i++)
+    	fullname[n++] = dirent->deName[i];
+    if (n > 0 && (uint8_t)fullname[0] == SLOT_E5)
+    	fullname[0] = (char)SLOT_DELETED;
+    if (dirent->deExtension[0] != ' ')
+    	fullname[n++] = '.';
+    for (i = 0; i < 3 && dirent->deExtension[i] != ' '; i++)
+    	fullname[n++] = dirent->deExtension[i];
+    fullname[n] = '\0';
+}
+
+
+/* find_path looks up a slash-separated path in the disk image, ignoring
+   case, and returns its directory entry, or NULL if there isn't one.
+   If parent isn't NULL, the first cluster of the directory holding the
+   entry (0 for the root) is stored there */
+struct direntry *find_path(char *path, uint16_t *parent,
+			   uint8_t *image_buf, struct bpb33* bpb) {
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    char buf[MAXPATHLEN + 1];
+    char *component, *rest;
+    uint16_t dir = MSDOSFSROOT;
+
+    strncpy(buf, path, MAXPATHLEN);
+    buf[MAXPATHLEN] = '\0';
+    component = strtok_r(buf, "/\\", &rest);
+
+    while (component != NULL) {
+    	struct direntry *found = NULL;
+    	uint16_t cluster = dir;
+    	struct chain_walk w;
+
+    	chain_walk_init(&w, dir, image_buf, bpb);
+    	while (dir == MSDOSFSROOT || chain_walk_next(&w, &cluster)) {
+    	    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    	    int nslots = cluster == MSDOSFSROOT ? bpb->bpbRootDirEnts
+    		: (int)(clust_size / sizeof(struct direntry));
+    	    int i;
+
+    	    for (i = 0; i < nslots; i++, dirent++) {
+    		char name[MAXFILENAME];
+    		if (dirent->deName[0] == SLOT_EMPTY)
+    		    break;
+    		if (dirent->deName[0] == SLOT_DELETED
+    		    || (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+    		    || (dirent->deAttributes & ATTR_VOLUME) != 0)
+    		    continue;
+    		dirent_name(name, dirent);
+    		if (strcasecmp(name, component) == 0) {
+    		    found = dirent;
+    		    break;
+    		}
+    	    }
+    	    if (found != NULL || i < nslots || cluster == MSDOSFSROOT)
+    		break;
+    	}
+    	chain_walk_check(&w, path);
+    	if (found == NULL)
+    	    return NULL;
+
+    	component = strtok_r(NULL, "/\\", &rest);
+    	if (component == NULL) {
+    	    if (parent != NULL)
+    		*parent = dir;
+    	    return found;
+    	}
+    	if ((found->deAttributes & ATTR_DIRECTORY) == 0)
+    	    return NULL;
+    	dir = getushort(found->deStartCluster);
+    }
+    return NULL;     // empty path
+}
+
+
+/* CRC32C (the Castagnoli polynomial, reflected), for checking copies.
+   Where the CPU has SSE4.2 its crc32 instruction does eight bytes at a
+   time; elsewhere we use slicing-by-8 tables, built once at startup */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc_table[8][256];
+
+__attribute__((constructor))
+static void crc32c_init(void) {
+    uint32_t i, j, crc;
+
+    for (i = 0; i < 256; i++) {
+    	crc = i;
+    	for (j = 0; j < 8; j++)
+    	    crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+    	crc_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+    	for (j = 1; j < 8; j++)
+    	    crc_table[j][i] = (crc_table[j-1][i] >> 8)
+    		^ crc_table[0][crc_table[j-1][i] & 0xff];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+    	uint64_t w;
+    	memcpy(&w, p, 8);
+    	w ^= crc;
+    	crc = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff]
+    	    ^ crc_table[5][(w >> 16) & 0xff] ^ crc_table[4][(w >> 24) & 0xff]
+    	    ^ crc_table[3][(w >> 32) & 0xff] ^ crc_table[2][(w >> 40) & 0xff]
+    	    ^ crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+    	p += 8;
+    	len -= 8;
+    }
+    while (len-- > 0)
+    	crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t crc64 = crc;
+
+    while (len >= 8) {
+    	uint64_t w;
+    	memcpy(&w, p, 8);
+    	crc64 = _mm_crc32_u64(crc64, w);
+    	p += 8;
+    	len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len-- > 0)
+    	crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/* crc32c carries the checksum crc on over len bytes at p.  Start with
+   0 and feed the data through in as many pieces as you like */
+uint32_t crc32c(uint32_t crc, const uint8_t *p, size_t len) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    	return ~crc32c_hw(~crc, p, len);
+#endif
+    return ~crc32c_sw(~crc, p, len);
+}
+
+
+/* parse_size reads a byte count from an option argument into *size.
+   It returns FALSE, for the caller to print its usage, if the argument
+   isn't all digits (decimal, or hex or octal the C way) or doesn't fit
+   in 32 bits */
+int parse_size(char *arg, uint32_t *size) {
+    char *end;
+    unsigned long long v;
+
+    if (!isdigit((unsigned char)*arg))
+    	return FALSE;
+    errno = 0;
+    v = strtoull(arg, &end, 0);
+    if (*end != '\0' || errno == ERANGE || v > UINT32_MAX)
+    	return FALSE;
+    *size = v;
+    return TRUE;
+}
@@ -12,6 +12,17 @@
 /* prototypes for functions in dos.c */
 
 #include <stdint.h>
+#include <stddef.h>
+
+/* a run of contiguous clusters */
+struct extent {
+    uint16_t start;
+    uint16_t len;
+};
+
+/* placement policies for freemap_alloc */
+#define FIT_BEST 0              /* the smallest free run that fits */
+#define FIT_FIRST 1             /* the first free run on disk that fits */
 
 uint8_t *mmap_file(char *, int *);
 void unmmap_file(uint8_t *, int *);
@@ -24,9 +35,75 @@ void set_fat_entry(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
 
 int is_end_of_file(uint16_t);
 int is_valid_cluster(uint16_t, struct bpb33 *);
+uint16_t cluster_count(struct bpb33 *);
 
 uint8_t *root_dir_addr(uint8_t *, struct bpb33 *);
 
 uint8_t *cluster_to_addr(uint16_t, uint8_t *, struct bpb33 *);
 
+void set_fat_run(uint16_t, uint16_t, uint16_t, uint8_t *, struct bpb33 *);
+void clear_fat_run(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
+
+uint16_t chain_extent(uint16_t, uint16_t *, uint8_t *, struct bpb33 *);
+
+/* a bounded walk along a cluster chain; see chain_walk_init */
+#define CHAIN_OK 0              /* still going */
+#define CHAIN_END 1             /* reached the end of the chain */
+#define CHAIN_BROKEN 2          /* ran into a free, bad or reserved entry */
+#define CHAIN_LOOP 3            /* came back to a cluster already visited */
+
+struct chain_walk {
+    uint16_t cluster;           /* the next cluster to hand out */
+    uint32_t steps;             /* clusters handed out so far */
+    uint32_t limit;             /* the most there can be */
+    uint16_t loop;              /* where the loop closed, for CHAIN_LOOP */
+    int status;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint8_t visited[4096 / 8];  /* one bit for every possible FAT12 cluster */
+};
+
+void chain_walk_init(struct chain_walk *, uint16_t, uint8_t *, struct bpb33 *);
+int chain_walk_next(struct chain_walk *, uint16_t *);
+int chain_walk_extent(struct chain_walk *, uint16_t *, uint16_t *);
+void chain_walk_check(struct chain_walk *, char *);
+
+/* the directories above the one being walked, to catch a directory
+   inside itself; see dir_trail_enter.  Every level of a path takes at
+   least two characters, so a real tree is never deeper than this */
+#define MAXDIRDEPTH (MAXPATHLEN / 2)
+
+struct dir_trail {
+    int depth;
+    uint16_t clusters[MAXDIRDEPTH + 1];
+};
+
+void dir_trail_enter(struct dir_trail *, uint16_t, char *);
+void dir_trail_leave(struct dir_trail *);
+
+uint16_t chain_seek(uint16_t, uint32_t, uint8_t *, struct bpb33 *);
+uint16_t chain_nth(uint16_t, uint32_t, uint8_t *, struct bpb33 *);
+void chain_index_flush(void);
+
+int freemap_alloc(uint16_t, int, struct extent *, uint8_t *, struct bpb33 *);
+int freemap_alloc_chain(uint32_t, struct extent **, uint8_t *, struct bpb33 *);
+void freemap_reserve(uint16_t, uint8_t *, struct bpb33 *);
+void freemap_release(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
+uint32_t freemap_free_clusters(uint8_t *, struct bpb33 *);
+
+uint32_t free_chain(uint16_t, uint8_t *, struct bpb33 *);
+
+struct direntry;
+void write_dirent(struct direntry *, char *, uint8_t, uint16_t, uint32_t);
+struct direntry *create_dirent(uint16_t, char *, uint8_t, uint16_t, uint32_t,
+			       uint8_t *, struct bpb33 *);
+void dir_hint_forget(uint16_t);
+
+void dirent_name(char *, struct direntry *);
+struct direntry *find_path(char *, uint16_t *, uint8_t *, struct bpb33 *);
+
+uint32_t crc32c(uint32_t, const uint8_t *, size_t);
+
+int parse_size(char *, uint32_t *);
+
 #endif // __DOS_H__
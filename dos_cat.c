@@ -7,6 +7,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -112,8 +115,10 @@ struct direntry *follow_dir(char *searchpath, uint16_t cluster,
     }
 
     struct direntry *rv = NULL;
+    struct chain_walk w;
 
-    while (is_valid_cluster(cluster, bpb))
+    chain_walk_init(&w, cluster, image_buf, bpb);
+    while (rv == NULL && chain_walk_next(&w, &cluster))
     {
         struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
 
@@ -142,9 +147,8 @@ struct direntry *follow_dir(char *searchpath, uint16_t cluster,
 
             dirent++;
 	}
-
-	cluster = get_fat_entry(cluster, image_buf, bpb);
     }
+    chain_walk_check(&w, searchpath);
 
     return rv;
 }
@@ -199,35 +203,156 @@ struct direntry *find_file(char *searchpath, uint8_t *image_buf, struct bpb33 *b
 }
 
 
-void do_cat(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
+/* number of runs we gather up before handing them to writev when we
+   can't use sendfile */
+#define CAT_IOV_BATCH 64
+
+
+/* send_run pushes len bytes starting at offset in the image file
+   straight from the page cache to out_fd.  It returns the number of
+   bytes sent; if that's short, errno says why */
+size_t send_run(int out_fd, int image_fd, off_t offset, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = sendfile(out_fd, image_fd, &offset, len - sent);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (n == 0)
+        {
+            /* image is shorter than the FAT says it is */
+            errno = EIO;
+            break;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+
+/* flush_iov writes out a batch of iovecs, picking up where it left off
+   after a short write */
+void flush_iov(int out_fd, struct iovec *iov, int count)
 {
-    uint16_t cluster = getushort(dirent->deStartCluster);
-    uint32_t bytes_remaining = getulong(dirent->deFileSize);
+    while (count > 0)
+    {
+        ssize_t n = writev(out_fd, iov, count);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+
+/* do_cat writes length bytes of the file, starting at offset, out a
+   run of contiguous clusters at a time.  The first cluster is found
+   through the chain's skip index rather than by walking the chain from
+   the start.  Each run goes to stdout with sendfile, so the data never
+   passes through user space; if stdout can't take sendfile, the runs
+   are gathered straight from the mapping into large writev batches.
+   A chain that loops back on itself stops the cat with an error,
+   rather than repeating data until the size runs out */
+void do_cat(struct direntry *dirent, uint32_t offset, uint32_t length,
+            int image_fd, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint16_t start_cluster = getushort(dirent->deStartCluster);
+    uint32_t file_size = getulong(dirent->deFileSize);
     uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t bytes_remaining, skip;
+    uint16_t cluster, len;
+    struct chain_walk w;
+    int use_sendfile = TRUE;
+    struct iovec iov[CAT_IOV_BATCH];
+    int niov = 0;
 
     char buffer[MAXFILENAME];
     get_dirent(dirent, buffer);
 
-    fprintf(stderr, "doing cat for %s, size %d\n", buffer, bytes_remaining);
+    fprintf(stderr, "doing cat for %s, size %d\n", buffer, file_size);
+
+    if (offset >= file_size)
+        return;
+    bytes_remaining = file_size - offset;
+    if (length < bytes_remaining)
+        bytes_remaining = length;
 
-    while (is_valid_cluster(cluster, bpb))
+    /* one lookup, so follow the chain there rather than index it */
+    cluster = offset < cluster_size ? start_cluster
+        : chain_nth(start_cluster, offset / cluster_size, image_buf, bpb);
+    skip = offset % cluster_size;
+
+    chain_walk_init(&w, cluster, image_buf, bpb);
+    while (bytes_remaining > 0 && chain_walk_extent(&w, &cluster, &len))
     {
+        uint32_t nbytes = len * cluster_size - skip;
+
         /* map the cluster number to the data location */
-        uint8_t *p = cluster_to_addr(cluster, image_buf, bpb);
+        uint8_t *p = cluster_to_addr(cluster, image_buf, bpb) + skip;
+        skip = 0;
 
-        uint32_t nbytes = bytes_remaining > cluster_size ? cluster_size : bytes_remaining;
+        if (nbytes > bytes_remaining)
+            nbytes = bytes_remaining;
+
+        if (use_sendfile)
+        {
+            size_t sent = send_run(STDOUT_FILENO, image_fd, p - image_buf, nbytes);
+            if (sent < nbytes)
+            {
+                if (errno != EINVAL && errno != ENOSYS)
+                {
+                    fprintf(stderr, "write failed: %s\n", strerror(errno));
+                    exit(1);
+                }
+                /* stdout isn't something sendfile can write to */
+                use_sendfile = FALSE;
+                p += sent;
+                nbytes -= sent;
+                bytes_remaining -= sent;
+            }
+        }
+
+        if (!use_sendfile)
+        {
+            iov[niov].iov_base = p;
+            iov[niov].iov_len = nbytes;
+            if (++niov == CAT_IOV_BATCH)
+            {
+                flush_iov(STDOUT_FILENO, iov, niov);
+                niov = 0;
+            }
+        }
 
-        fwrite(p, 1, nbytes, stdout);
         bytes_remaining -= nbytes;
-    
-        cluster = get_fat_entry(cluster, image_buf, bpb);
     }
+
+    flush_iov(STDOUT_FILENO, iov, niov);
+    chain_walk_check(&w, buffer);
 }
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename> <filename>\n", progname);
+    fprintf(stderr, "usage: %s [--offset <bytes>] [--length <bytes>] <imagename> <filename>\n", progname);
     exit(1);
 }
 
@@ -237,17 +362,43 @@ int main(int argc, char** argv)
     uint8_t *image_buf;
     int fd;
     struct bpb33* bpb;
-    if (argc != 3)
+    uint32_t offset = 0;
+    uint32_t length = UINT32_MAX;
+    int c;
+
+    static struct option long_options[] = {
+        {"offset", required_argument, NULL, 'o'},
+        {"length", required_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((c = getopt_long(argc, argv, "o:l:", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'o':
+            if (!parse_size(optarg, &offset))
+                usage(argv[0]);
+            break;
+        case 'l':
+            if (!parse_size(optarg, &length))
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    image_buf = mmap_file(argv[optind], &fd);
     bpb = check_bootsector(image_buf);
 
-    struct direntry *dirent = find_file(argv[2], image_buf, bpb);
+    struct direntry *dirent = find_file(argv[optind + 1], image_buf, bpb);
     if (dirent)
-        do_cat(dirent, image_buf, bpb);
+        do_cat(dirent, offset, length, fd, image_buf, bpb);
 
     unmmap_file(image_buf, &fd);
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -9,6 +10,8 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -25,13 +28,13 @@ void get_name(char *fullname, struct direntry *dirent)
     char extension[4];
     int i;
 
-    name[8] = ' ';
-    extension[3] = ' ';
+    name[8] = '\0';
+    extension[3] = '\0';
     memcpy(name, &(dirent->deName[0]), 8);
     memcpy(extension, dirent->deExtension, 3);
 
     /* names are space padded - remove the padding */
-    for (i = 8; i > 0; i--) {
+    for (i = 7; i > 0; i--) {
     	if (name[i] == ' ')
     	    name[i] = '\0';
     	else
@@ -40,7 +43,7 @@ void get_name(char *fullname, struct direntry *dirent)
 
     /* extensions aren't normally space padded - but remove the
        padding anyway if it's there */
-    for (i = 3; i > 0; i--)
+    for (i = 2; i >= 0; i--)
     {
 	if (extension[i] == ' ')
 	    extension[i] = '\0';
@@ -50,8 +53,8 @@ void get_name(char *fullname, struct direntry *dirent)
     fullname[0]='\0';
     strcat(fullname, name);
 
-    /* append the extension if it's not a directory */
-    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) {
+    /* append the extension if there is one */
+    if (extension[0] != '\0') {
     	strcat(fullname, ".");
     	strcat(fullname, extension);
     }
@@ -61,10 +64,10 @@ void get_name(char *fullname, struct direntry *dirent)
 /* find_file seeks through the directories in the memory disk image,
    until it finds the named file */
 
-/* flags, depending on whether we're searching for a file or a
-   directory */
+/* flags, depending on whether we're searching for a file, or for
+   whatever the name refers to */
 #define FIND_FILE 0
-#define FIND_DIR 1
+#define FIND_ANY 2
 
 struct direntry* find_file(char *infilename, uint16_t cluster,
 			   int find_mode,
@@ -76,8 +79,12 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
     struct direntry *dirent;
     uint16_t dir_cluster;
     char fullname[13];
+    struct chain_walk w;
 
     /* find the first dirent in this directory */
+    chain_walk_init(&w, cluster, image_buf, bpb);
+    if (cluster != MSDOSFSROOT && !chain_walk_next(&w, &cluster))
+    	return NULL;
     dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
 
     /* first we need to split the file name we're looking for into the
@@ -105,8 +112,6 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
     	if (*next_name == '\0')	{
     	    /* end of name - no slashes found */
     	    next_name = NULL;
-    	    if (find_mode == FIND_DIR)
-        		return dirent;
     	    break;
     	}
     	next_name++;
@@ -134,6 +139,8 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
         		if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
         		    // it's a directory
         		    if (next_name == NULL) {
+            			if (find_mode == FIND_ANY)
+            			    return dirent;
             			fprintf(stderr, "Cannot copy out a directory\n");
             			exit(1);
         		    }
@@ -156,60 +163,263 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
     	if (cluster == 0)
     	    dirent++;      // root dir is special
     	else {
-    	    cluster = get_fat_entry(cluster, image_buf, bpb);
+    	    if (!chain_walk_next(&w, &cluster)) {
+    		chain_walk_check(&w, infilename);
+    		return NULL;
+    	    }
     	    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
     	}
     }
 }
 
 
-/* copy_out_file actually does the work of copying, recursing through
-   the clusters of the memory disk image, and copying out a cluster at
-   a time */
+/* copy_range moves len bytes at in_off in the image file to out_off in
+   out_fd inside the kernel.  It returns the number of bytes copied; if
+   that's short, errno says why */
 
-void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
-		   uint8_t *image_buf, struct bpb33* bpb)
+size_t copy_range(int image_fd, off_t in_off, int out_fd, off_t out_off,
+		  size_t len)
 {
-    int total_clusters, clust_size;
-    uint8_t *p;
+    size_t done = 0;
+    while (done < len) {
+    	ssize_t n = copy_file_range(image_fd, &in_off, out_fd, &out_off,
+    				    len - done, 0);
+    	if (n < 0) {
+    	    if (errno == EINTR)
+    		continue;
+    	    break;
+    	}
+    	if (n == 0) {
+    	    /* image is shorter than the FAT says it is */
+    	    errno = EIO;
+    	    break;
+    	}
+    	done += n;
+    }
+    return done;
+}
 
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+/* write_range writes len bytes from buf at offset in fd, picking up
+   where it left off after a short write.  Outputs that can't seek
+   (pipes) are written sequentially instead */
 
-    assert(cluster <= total_clusters);
+void write_range(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    static int seekable = TRUE;
+    while (len > 0) {
+    	ssize_t n = seekable ? pwrite(fd, buf, len, offset) : write(fd, buf, len);
+    	if (n < 0) {
+    	    if (errno == EINTR)
+    		continue;
+    	    if (errno == ESPIPE && seekable) {
+    		seekable = FALSE;
+    		continue;
+    	    }
+    	    fprintf(stderr, "Write failed: %s\n", strerror(errno));
+    	    exit(1);
+    	}
+    	buf += n;
+    	offset += n;
+    	len -= n;
+    }
+}
 
-    if (cluster == 0) {
-    	fprintf(stderr, "Bad file termination\n");
-    	return;
+/* -c and -C: checksum the data as it's copied, and print the result
+   or check it against expected_crc */
+static int checksum = FALSE;
+static int have_expected = FALSE;
+static uint32_t expected_crc;
+
+/* print_digest prints the CRC32C of the file name we just copied */
+
+void print_digest(char *name, uint32_t crc)
+{
+    fprintf(stderr, "%08x  %s\n", crc, name);
+}
+
+/* check_digest prints the CRC32C of the file name we just copied, or
+   if we were given one to expect, checks it.  It returns FALSE, having
+   said so, if it differs; the caller undoes the copy and stops */
+
+int check_digest(char *name, uint32_t crc)
+{
+    if (!have_expected) {
+    	print_digest(name, crc);
+    	return TRUE;
     }
-    else if (is_end_of_file(cluster))
-    	return;
+    if (crc != expected_crc) {
+    	fprintf(stderr, "Checksum mismatch for %s: got %08x, expected %08x\n",
+    		name, crc, expected_crc);
+    	return FALSE;
+    }
+    return TRUE;
+}
 
-    /* map the cluster number to the data location */
-    p = cluster_to_addr(cluster, image_buf, bpb);
+/* sparse copy-out: all-zero clusters are left as holes in the output
+   rather than written, and we keep count of how many there were */
+static int sparse = FALSE;
+static uint32_t zero_clusters, total_clusters;
 
-    if (bytes_remaining <= clust_size)
-    	fwrite(p, bytes_remaining, 1, fd);     // last cluster
-    else {
-    	/* more clusters after this one */
-    	fwrite(p, clust_size, 1, fd);
+/* is_zero says whether len bytes at p are all zero.  It ORs eight
+   words together per pass, which the compiler turns into vector
+   instructions, and only tests the result once per 64 bytes.  Cluster
+   sizes are always a multiple of 64 */
+
+int is_zero(uint8_t *p, size_t len)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    size_t i, n = len / sizeof(uint64_t);
 
-    	/* recurse, continuing to copy */
-    	copy_out_file(fd, get_fat_entry(cluster, image_buf, bpb),
-    		      bytes_remaining - clust_size, image_buf, bpb);
+    for (i = 0; i + 8 <= n; i += 8) {
+    	if ((w[i] | w[i+1] | w[i+2] | w[i+3]
+    	     | w[i+4] | w[i+5] | w[i+6] | w[i+7]) != 0)
+    	    return FALSE;
+    }
+    for (; i < n; i++)
+    	if (w[i] != 0)
+    	    return FALSE;
+    for (i = n * sizeof(uint64_t); i < len; i++)
+    	if (p[i] != 0)
+    	    return FALSE;
+    return TRUE;
+}
+
+/* put_run copies nbytes of the image at p to out_off in out_fd, with
+   copy_file_range while that keeps working and pwrite after that */
+
+void put_run(int out_fd, uint8_t *p, size_t nbytes, off_t out_off,
+	     int *use_copy_range, int image_fd, uint8_t *image_buf)
+{
+    size_t done = 0;
+
+    if (*use_copy_range) {
+    	done = copy_range(image_fd, p - image_buf, out_fd, out_off, nbytes);
+    	if (done < nbytes) {
+    	    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS
+    		&& errno != EOPNOTSUPP) {
+    		fprintf(stderr, "Copy failed: %s\n", strerror(errno));
+    		exit(1);
+    	    }
+    	    *use_copy_range = FALSE;
+    	}
+    }
+    if (done < nbytes)
+    	write_range(out_fd, p + done, nbytes - done, out_off + done);
+}
+
+/* copy_out_file actually does the work of copying, walking the
+   clusters of the memory disk image a contiguous extent at a time.
+   Each extent goes across with copy_file_range, so the kernel moves
+   the data (or reflinks it, on filesystems that can); if it can't do
+   that between these two files, we pwrite straight from the mapping.
+
+   In sparse mode each extent is split further around its all-zero
+   clusters, which are skipped over rather than written, and the file
+   is then cut to its full size so any trailing hole is kept.
+
+   If crc isn't NULL, the CRC32C of the data is carried on in it */
+
+void copy_out_file(int out_fd, uint16_t cluster, uint32_t bytes_remaining,
+		   uint32_t *crc, int image_fd, uint8_t *image_buf,
+		   struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint32_t size = bytes_remaining;
+    uint32_t zeros = 0, clusters = 0;
+    off_t out_off = 0;
+    int use_copy_range = TRUE;
+    int holes = FALSE;
+    struct chain_walk w;
+    struct stat st;
+    char what[32];
+    int err;
+
+    /* holes only make sense in a regular file; anything else gets the
+       zeros written out */
+    if (sparse && fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode))
+    	holes = TRUE;
+
+    /* reserve the space up front, so the file gets laid out in one go.
+       Not every output (pipes, devices) can be preallocated; only
+       running out of room is worth stopping for */
+    if (!holes && size > 0 && (err = posix_fallocate(out_fd, 0, size)) != 0
+	&& (err == ENOSPC || err == EFBIG)) {
+    	fprintf(stderr, "Can't allocate %u bytes for the copy: %s\n",
+    		size, strerror(err));
+    	exit(1);
+    }
+
+    snprintf(what, sizeof(what), "file at cluster %u", cluster);
+    chain_walk_init(&w, cluster, image_buf, bpb);
+    while (bytes_remaining > 0) {
+    	uint16_t nclust;
+    	uint32_t nbytes, run, i;
+    	uint8_t *p;
+
+    	if (!chain_walk_extent(&w, &cluster, &nclust)) {
+    	    chain_walk_check(&w, what);
+    	    fprintf(stderr, "Bad file termination\n");
+    	    break;
+    	}
+
+    	/* map the extent to the data location */
+    	nbytes = nclust * clust_size;
+    	if (nbytes > bytes_remaining)
+    	    nbytes = bytes_remaining;
+    	p = cluster_to_addr(cluster, image_buf, bpb);
+
+    	if (!holes) {
+    	    put_run(out_fd, p, nbytes, out_off, &use_copy_range,
+    		    image_fd, image_buf);
+    	}
+    	else {
+    	    /* write out each stretch of non-zero clusters, skipping
+    	       the zero ones */
+    	    run = 0;
+    	    for (i = 0; i < nbytes; i += clust_size) {
+    		uint32_t len = nbytes - i < clust_size ? nbytes - i : clust_size;
+    		clusters++;
+    		if (!is_zero(p + i, len))
+    		    continue;
+    		zeros++;
+    		if (i > run)
+    		    put_run(out_fd, p + run, i - run, out_off + run,
+    			    &use_copy_range, image_fd, image_buf);
+    		run = i + len;
+    	    }
+    	    if (nbytes > run)
+    		put_run(out_fd, p + run, nbytes - run, out_off + run,
+    			&use_copy_range, image_fd, image_buf);
+    	}
+    	if (crc != NULL)
+    	    *crc = crc32c(*crc, p, nbytes);
+
+    	out_off += nbytes;
+    	bytes_remaining -= nbytes;
+    }
+
+    /* the chain ended early - don't leave preallocated space hanging
+       off the end.  A sparse file may have a hole at the end, so it
+       always gets set to its final size */
+    if (out_off < size || holes)
+    	ftruncate(out_fd, out_off);
+
+    if (holes) {
+    	__atomic_add_fetch(&zero_clusters, zeros, __ATOMIC_RELAXED);
+    	__atomic_add_fetch(&total_clusters, clusters, __ATOMIC_RELAXED);
     }
-    return;
 }
 
 /* copyout copies a file from the FAT-12 memory disk image to a
    regular file in the file system */
 
-void copyout(char *infilename, char* outfilename, uint8_t *image_buf, struct bpb33* bpb)
+void copyout(char *infilename, char* outfilename,
+	     int image_fd, uint8_t *image_buf, struct bpb33* bpb)
 {
     struct direntry *dirent = (void*)1;
-    FILE *fd;
+    int fd;
     uint16_t start_cluster;
-    uint32_t size;
+    uint32_t size, crc = 0;
 
     /* skip the volume name */
     assert(strncmp("a:", infilename, 2) == 0);
@@ -224,8 +434,8 @@ void copyout(char *infilename, char* outfilename, uint8_t *image_buf, struct bpb
     }
 
     /* open the real file for writing */
-    fd = fopen(outfilename, "w");
-    if (fd == NULL) {
+    fd = open(outfilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
     	fprintf(stderr, "Can't open file %s to copy data out\n",
     		outfilename);
     	exit(1);
@@ -234,196 +444,946 @@ void copyout(char *infilename, char* outfilename, uint8_t *image_buf, struct bpb
     /* do the actual copy out*/
     start_cluster = getushort(dirent->deStartCluster);
     size = getulong(dirent->deFileSize);
-    copy_out_file(fd, start_cluster, size, image_buf, bpb);
+    copy_out_file(fd, start_cluster, size, checksum ? &crc : NULL,
+    		  image_fd, image_buf, bpb);
+    if (checksum && !check_digest(infilename, crc))
+    	exit(1);
 
-    fclose(fd);
+    close(fd);
 }
 
-/* copy_in_file actually does the copying of the file into the memory
-   image, updates the FAT, and returns the starting cluster of the
-   file */
+/* read_fully reads up to len bytes from fd into buf, stopping early
+   only at end of file.  If the read fails it says so and returns -1 */
 
-uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
-		      uint32_t *size)
+ssize_t read_fully(int fd, uint8_t *buf, size_t len)
 {
-    uint32_t clust_size, total_clusters, i;
-    uint8_t *buf;
-    size_t bytes;
-    uint16_t start_cluster = 0;
-    uint16_t prev_cluster = 0;
-
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-    buf = malloc(clust_size);
-    while(1) {
-    	/* read a block of data, and store it */
-    	bytes = fread(buf, 1, clust_size, fd);
-    	if (bytes > 0) {
-    	    *size += bytes;
-
-    	    /* find a free cluster */
-    	    for (i = 2; i < total_clusters; i++) {
-        		if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE)
-        		    break;
-    	    }
-
-    	    if (i == total_clusters) {
-        		/* oops - we ran out of disk space */
-        		fprintf(stderr, "No more space in filesystem\n");
-        		/* we should clean up here, rather than just exit */
-        		exit(1);
-    	    }
-
-    	    /* remember the first cluster, as we need to store this in
-    	       the dirent */
-    	    if (start_cluster == 0)
-        		start_cluster = i;
-    	    else {
-        		/* link the previous cluster to this one in the FAT */
-        		assert(prev_cluster != 0);
-        		set_fat_entry(prev_cluster, i, image_buf, bpb);
-    	    }
-
-    	    /* make sure we've recorded this cluster as used */
-    	    set_fat_entry(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
-
-    	    /* copy the data into the cluster */
-    	    memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
+    size_t got = 0;
+    while (got < len) {
+    	ssize_t n = read(fd, buf + got, len - got);
+    	if (n < 0) {
+    	    if (errno == EINTR)
+    		continue;
+    	    fprintf(stderr, "Read failed: %s\n", strerror(errno));
+    	    return -1;
     	}
-    	if (bytes < clust_size)
+    	if (n == 0)
     	    break;
-    	    // We didn't real a full cluster, so we either got a read
-    	       // error, or reached end of file.  We exit anyway
-    	prev_cluster = i;
+    	got += n;
     }
+    return got;
+}
 
-    free(buf);
-    return start_cluster;
+/* alloc_chain reserves a chain big enough for size bytes - in one
+   piece if there's a free run that big - and links it up in the FAT in
+   one go.  The runs it is made of come back in *runs
+   (NULL for an empty file), and the number of them is returned.  If
+   there isn't room it says so and returns -1, having changed nothing */
+
+int alloc_chain(uint32_t size, struct extent **runs,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    int nruns, i;
+
+    *runs = NULL;
+    if (size == 0)
+    	return 0;
+
+    nruns = freemap_alloc_chain((size + clust_size - 1) / clust_size, runs,
+    				image_buf, bpb);
+    if (nruns == 0) {
+    	/* oops - we ran out of disk space */
+    	fprintf(stderr, "No more space in filesystem\n");
+    	return -1;
+    }
+    for (i = 0; i < nruns; i++)
+    	set_fat_run((*runs)[i].start, (*runs)[i].len,
+    		    i + 1 < nruns ? (*runs)[i + 1].start : (FAT12_MASK & CLUST_EOFS),
+    		    image_buf, bpb);
+    return nruns;
 }
 
-/* write the values into a directory entry */
-void write_dirent(struct direntry *dirent, char *filename,
-		  uint16_t start_cluster, uint32_t size)
+/* fill_chain reads up to size bytes from fd straight into the mapped
+   clusters of runs, and zeroes whatever part of the clusters the data
+   doesn't cover.  The number of bytes read goes in *total.  It only
+   touches the data clusters, never the FAT, so it's safe on a worker
+   thread; it returns FALSE if reading fd failed, for the caller to
+   deal with.  If crc isn't NULL, the CRC32C of what was read is
+   carried on in it */
+
+int fill_chain(int fd, struct extent *runs, int nruns, uint32_t size,
+	       uint32_t *total, uint32_t *crc, uint8_t *image_buf, struct bpb33* bpb)
 {
-    char *p, *p2;
-    char *uppername;
-    int len, i;
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    int short_read = FALSE;
+    int i;
 
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
+    *total = 0;
+    for (i = 0; i < nruns; i++) {
+    	uint8_t *p = cluster_to_addr(runs[i].start, image_buf, bpb);
+    	uint32_t room = runs[i].len * clust_size;
+    	uint32_t want = size - *total;
+    	ssize_t got = 0;
+
+    	if (want > room)
+    	    want = room;
+    	if (!short_read) {
+    	    got = read_fully(fd, p, want);
+    	    if (got < 0)
+    		return FALSE;
+    	    short_read = got < want;
+    	    if (crc != NULL)
+    		*crc = crc32c(*crc, p, got);
+    	}
+    	*total += got;
 
-    /* extract just the filename part */
-    uppername = strdup(filename);
-    p2 = uppername;
-    for (i = 0; i < strlen(filename); i++) {
-    	if (p2[i] == '/' || p2[i] == '\\')
-    	    uppername = p2 + i + 1;
+    	/* don't leave stale data in the slack at the end of the file */
+    	memset(p + got, 0, room - got);
     }
+    return TRUE;
+}
 
-    /* convert filename to upper case */
-    for (i = 0; i < strlen(uppername); i++)
-    	uppername[i] = toupper(uppername[i]);
+/* trim_chain cuts the chain made of runs down to the clusters needed
+   for size bytes, giving the rest back */
 
-    /* set the file name and extension */
-    memset(dirent->deName, ' ', 8);
-    p = strchr(uppername, '.');
-    memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL)
-    	fprintf(stderr, "No filename extension given - defaulting to .___\n");
-    else {
-    	*p = '\0';
-    	p++;
-    	len = strlen(p);
-    	if (len > 3) len = 3;
-        	memcpy(dirent->deExtension, p, len);
+void trim_chain(struct extent *runs, int nruns, uint32_t size,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint32_t keep = (size + clust_size - 1) / clust_size;
+    int i;
+
+    for (i = 0; i < nruns; i++) {
+    	if (keep >= runs[i].len) {
+    	    keep -= runs[i].len;
+    	    if (keep == 0 && i + 1 < nruns)
+    		set_fat_entry(runs[i].start + runs[i].len - 1,
+    			      FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+    	    continue;
+    	}
+    	if (keep > 0)
+    	    set_fat_entry(runs[i].start + keep - 1,
+    			  FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+    	freemap_release(runs[i].start + keep, runs[i].len - keep, image_buf, bpb);
+    	keep = 0;
     }
+}
 
-    if (strlen(uppername)>8)
-        uppername[8]='\0';
-    memcpy(dirent->deName, uppername, strlen(uppername));
-    free(p2);
+/* source_size checks that fd is a regular file that will fit in a
+   FAT filesystem, and returns its size */
 
-    /* set the attributes and file size */
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
-    putulong(dirent->deFileSize, size);
+uint32_t source_size(int fd)
+{
+    struct stat st;
 
-    /* could also set time and date here if we really
-       cared... */
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    	fprintf(stderr, "Can only copy in regular files\n");
+    	exit(1);
+    }
+    if (st.st_size > UINT32_MAX) {
+    	fprintf(stderr, "File is too big for a FAT filesystem\n");
+    	exit(1);
+    }
+    return st.st_size;
 }
 
+/* copy_in_file actually does the copying of the file into the memory
+   image, into the chain made of runs that was reserved and linked up
+   in the FAT for *size bytes.  The data is read straight into the
+   mapped clusters, and *size is set to how much there turned out to
+   be.  It returns FALSE, with the chain still whole, if the read
+   failed */
+
+int copy_in_file(int fd, struct extent *runs, int nruns, uint32_t *size,
+		 uint32_t *crc, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t want = *size;
+
+    if (!fill_chain(fd, runs, nruns, want, size, crc, image_buf, bpb))
+    	return FALSE;
 
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
+    /* the file shrank while we were copying it; give back the
+       clusters we didn't need */
+    if (*size < want)
+    	trim_chain(runs, nruns, *size, image_buf, bpb);
+    return TRUE;
+}
+
+/* find_parent_dir returns the first cluster of the directory that
+   the path filename would go in (0 for the root directory) */
 
-void create_dirent(struct direntry *dirent, char *filename,
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
+uint16_t find_parent_dir(char *filename, uint8_t *image_buf, struct bpb33* bpb)
 {
-    while (1) {
-    	if (dirent->deName[0] == SLOT_EMPTY) {
-    	    /* we found an empty slot at the end of the directory */
-    	    write_dirent(dirent, filename, start_cluster, size);
-    	    dirent++;
+    char parent[MAXPATHLEN + 1];
+    struct direntry *dirent;
+    char *slash, *p;
+
+    strncpy(parent, filename, MAXPATHLEN);
+    parent[MAXPATHLEN] = '\0';
+    slash = strrchr(parent, '/');
+    if (slash == NULL)
+    	return MSDOSFSROOT;
+    *slash = '\0';
+    for (p = parent; *p == '/'; p++)
+    	;
+    if (*p == '\0')
+    	return MSDOSFSROOT;
+
+    dirent = find_file(p, 0, FIND_ANY, image_buf, bpb);
+    if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0) {
+    	fprintf(stderr, "Directory does not exists in the disk image\n");
+    	exit(1);
+    }
+    return getushort(dirent->deStartCluster);
+}
 
-    	    /* make sure the next dirent is set to be empty, just in
-    	       case it wasn't before */
-    	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-    	    dirent->deName[0] = SLOT_EMPTY;
-    	    return;
-    	}
+/* how many clusters update_file compares per read */
+#define UPDATE_BATCH 64
 
-    	if (dirent->deName[0] == SLOT_DELETED) {
-    	    /* we found a deleted entry - we can just overwrite it */
-    	    write_dirent(dirent, filename, start_cluster, size);
-    	    return;
+/* update_file brings the existing file dirent in the disk image up to
+   date with the host file fd.  The host file is compared with the
+   existing chain a cluster at a time, and only the clusters that
+   differ are written; the chain is then extended or cut back at the
+   tail to fit the new size.  So the pages we dirty scale with the size
+   of the change, not the size of the file.  If crc isn't NULL, the
+   CRC32C of the host file is carried on in it */
+
+void update_file(int fd, struct direntry *dirent, uint32_t *crc,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint16_t start = getushort(dirent->deStartCluster);
+    uint16_t cluster = 0, run_len = 0, last = 0;
+    uint32_t size, remaining, rewritten = 0;
+    uint8_t *buf;
+    struct chain_walk w;
+    char what[32];
+
+    size = remaining = source_size(fd);
+    buf = malloc(UPDATE_BATCH * clust_size);
+
+    /* compare and patch the part of the file the chain already covers,
+       taking long runs a piece at a time */
+    chain_walk_init(&w, start, image_buf, bpb);
+    while (remaining > 0) {
+    	uint16_t len, used, i;
+    	uint32_t want;
+    	ssize_t got;
+    	uint8_t *p;
+
+    	if (run_len == 0 && !chain_walk_extent(&w, &cluster, &run_len))
+    	    break;
+    	len = run_len < UPDATE_BATCH ? run_len : UPDATE_BATCH;
+    	want = len * clust_size;
+    	if (want > remaining)
+    	    want = remaining;
+    	got = read_fully(fd, buf, want);
+    	if (got < 0)
+    	    exit(1);
+    	if (got < want) {
+    	    fprintf(stderr, "File shrank while it was being copied in\n");
+    	    exit(1);
+    	}
+    	if (crc != NULL)
+    	    *crc = crc32c(*crc, buf, got);
+
+    	/* the slack at the end of the last cluster should be zero */
+    	used = (got + clust_size - 1) / clust_size;
+    	memset(buf + got, 0, used * clust_size - got);
+
+    	p = cluster_to_addr(cluster, image_buf, bpb);
+    	for (i = 0; i < used; i++) {
+    	    uint8_t *old = p + i * clust_size, *new = buf + i * clust_size;
+    	    if (memcmp(old, new, clust_size) != 0) {
+    		memcpy(old, new, clust_size);
+    		rewritten++;
+    	    }
+    	}
+    	remaining -= got;
+    	last = cluster + used - 1;
+    	cluster += len;
+    	run_len -= len;
+    }
+    free(buf);
+    snprintf(what, sizeof(what), "file at cluster %u", start);
+    chain_walk_check(&w, what);
+
+    if (remaining > 0) {
+    	/* the file grew: hang new clusters off the end of the chain */
+    	struct extent *runs;
+    	int nruns = alloc_chain(remaining, &runs, image_buf, bpb);
+    	uint32_t got;
+    	if (nruns < 0 || !fill_chain(fd, runs, nruns, remaining, &got, crc, image_buf, bpb))
+    	    exit(1);
+    	if (got < remaining) {
+    	    fprintf(stderr, "File shrank while it was being copied in\n");
+    	    exit(1);
+    	}
+    	if (last == 0)
+    	    putushort(dirent->deStartCluster, runs[0].start);
+    	else
+    	    set_fat_entry(last, runs[0].start, image_buf, bpb);
+    	rewritten += (remaining + clust_size - 1) / clust_size;
+    	free(runs);
+    }
+    else {
+    	/* the file shrank (or stayed put): cut the chain after the
+    	   last cluster we still need */
+    	if (last == 0) {
+    	    free_chain(start, image_buf, bpb);
+    	    putushort(dirent->deStartCluster, 0);
+    	}
+    	else {
+    	    uint16_t rest = get_fat_entry(last, image_buf, bpb);
+    	    if (!is_end_of_file(rest)) {
+    		set_fat_entry(last, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+    		free_chain(rest, image_buf, bpb);
+    	    }
     	}
-    	dirent++;
     }
+
+    putulong(dirent->deFileSize, size);
+    fprintf(stderr, "Rewrote %u of %u clusters\n", rewritten,
+	    (size + clust_size - 1) / clust_size);
+}
+
+/* undo_copyin takes a new file that couldn't be copied in back out
+   again - its chain from start, and its entry in the directory parent
+   - and stops */
+
+void undo_copyin(struct direntry *dirent, uint16_t parent, uint16_t start,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    free_chain(start, image_buf, bpb);
+    dirent->deName[0] = SLOT_DELETED;
+    dir_hint_forget(parent);
+    exit(1);
+}
+
+/* hash_file returns the CRC32C of everything in fd, and leaves it
+   back at the start */
+
+uint32_t hash_file(int fd)
+{
+    uint8_t *buf = malloc(64 * 1024);
+    uint32_t crc = 0;
+    ssize_t got;
+
+    while ((got = read_fully(fd, buf, 64 * 1024)) > 0)
+    	crc = crc32c(crc, buf, got);
+    free(buf);
+    if (got < 0 || lseek(fd, 0, SEEK_SET) < 0)
+    	exit(1);
+    return crc;
 }
 
 /* copyin copies a file from a regular file on the filesystem into a
-   file in the FAT-12 memory disk image  */
+   file in the FAT-12 memory disk image.  If update is set and the file
+   is already there, only the parts that changed are rewritten */
 
-void copyin(char *infilename, char* outfilename,
+void copyin(char *infilename, char* outfilename, int update,
 	    uint8_t *image_buf, struct bpb33* bpb)
 {
     struct direntry *dirent = (void*)1;
-    FILE *fd;
-    uint16_t start_cluster;
-    uint32_t size = 0;
+    struct extent *runs;
+    int fd, nruns, i;
+    uint16_t start_cluster, parent;
+    uint32_t size = 0, crc = 0;
 
     assert(strncmp("a:", outfilename, 2) == 0);
     outfilename+=2;
 
     /* check that the file doesn't already exist */
     dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
+    if (dirent != NULL && update) {
+    	fd = open(infilename, O_RDONLY);
+    	if (fd < 0) {
+    	    fprintf(stderr, "Can't open file %s to copy data in\n", infilename);
+    	    exit(1);
+    	}
+    	/* clusters are patched in place, so there'd be no taking
+    	   them back: check the file against -C before touching any */
+    	if (have_expected && !check_digest(infilename, hash_file(fd)))
+    	    exit(1);
+    	update_file(fd, dirent, checksum && !have_expected ? &crc : NULL,
+    		    image_buf, bpb);
+    	if (checksum && !have_expected)
+    	    print_digest(infilename, crc);
+    	close(fd);
+    	return;
+    }
     if (dirent != NULL) {
     	fprintf(stderr, "File %s already exists\n", outfilename);
     	exit(1);
     }
 
-    /* find the dirent of the directory to put the file in */
-    dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
-    if (dirent == NULL) {
-    	fprintf(stderr, "Directory does not exists in the disk image\n");
+    /* open the real file for reading, and make sure it's one we can
+       copy, before anything in the image is touched */
+    fd = open(infilename, O_RDONLY);
+    if (fd < 0) {
+    	fprintf(stderr, "Can't open file %s to copy data in\n",	infilename);
     	exit(1);
     }
+    size = source_size(fd);
+    parent = find_parent_dir(outfilename, image_buf, bpb);
 
-    /* open the real file for reading */
-    fd = fopen(infilename, "r");
-    if (fd == NULL) {
-    	fprintf(stderr, "Can't open file %s to copy data in\n",	infilename);
+    /* reserve the chain, then make the entry, so that running out of
+       room for either leaves nothing behind */
+    nruns = alloc_chain(size, &runs, image_buf, bpb);
+    if (nruns < 0)
+    	exit(1);
+    dirent = create_dirent(parent, outfilename, ATTR_NORMAL, 0, 0, image_buf, bpb);
+    if (dirent == NULL) {
+    	for (i = 0; i < nruns; i++)
+    	    freemap_release(runs[i].start, runs[i].len, image_buf, bpb);
+    	fprintf(stderr, "No room for %s in its directory\n", outfilename);
     	exit(1);
     }
 
     /* do the actual copy in*/
-    start_cluster = copy_in_file(fd, image_buf, bpb, &size);
+    start_cluster = nruns > 0 ? runs[0].start : 0;
+    if (!copy_in_file(fd, runs, nruns, &size, checksum ? &crc : NULL, image_buf, bpb))
+    	undo_copyin(dirent, parent, start_cluster, image_buf, bpb);
+    free(runs);
+    if (size == 0)
+    	start_cluster = 0;
+
+    /* the data isn't what we were told to expect */
+    if (checksum && !check_digest(infilename, crc))
+    	undo_copyin(dirent, parent, start_cluster, image_buf, bpb);
+
+    /* fill in the directory entry */
+    putushort(dirent->deStartCluster, start_cluster);
+    putulong(dirent->deFileSize, size);
+
+    close(fd);
+}
+
+/* Recursive copies.  The main thread walks the trees and owns every
+   change to the FAT and the directories; the file data is moved by a
+   pool of worker threads, which only ever touch the data clusters of
+   the file they were handed */
+
+struct copy_job {
+    char path[MAXPATHLEN + 1];  /* the file on the host */
+    uint16_t cluster;           /* copy out: first cluster of the file */
+    struct extent *runs;        /* copy in: the chain reserved for it */
+    int nruns;
+    struct direntry *dirent;    /* copy in: its entry */
+    uint32_t size;
+    uint32_t got;               /* copy in: how much the worker read */
+    int failed;                 /* copy in: the worker couldn't read it */
+    struct copy_job *next;
+};
+
+struct copy_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct copy_job *head, *tail;
+    struct copy_job *done;      /* copy in: finished jobs, for the main thread */
+    int closing;
+    int finished;
+    int copy_in;
+    int nthreads;
+    pthread_t *threads;
+    int image_fd;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+};
+
+struct copy_pool pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
 
-    /* create the directory entry */
-    create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
+/* run_job moves the data for one file.  On copy in it leaves the FAT
+   and the file's entry alone whatever happens: a file it couldn't read,
+   or that turned out shorter than its entry says, is only noted in the
+   job for the main thread to sort out (see settle_jobs) */
 
-    fclose(fd);
+void run_job(struct copy_job *job)
+{
+    uint32_t crc = 0;
+    int fd;
+
+    if (pool.copy_in) {
+    	fd = open(job->path, O_RDONLY);
+    	if (fd < 0) {
+    	    fprintf(stderr, "Can't open file %s to copy data in\n", job->path);
+    	    job->failed = TRUE;
+    	    return;
+    	}
+    	if (!fill_chain(fd, job->runs, job->nruns, job->size, &job->got,
+    			checksum ? &crc : NULL, pool.image_buf, pool.bpb)) {
+    	    job->failed = TRUE;
+    	    close(fd);
+    	    return;
+    	}
+    	if (job->got < job->size)
+    	    fprintf(stderr, "%s shrank while it was being copied in\n", job->path);
+    }
+    else {
+    	fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    	if (fd < 0) {
+    	    fprintf(stderr, "Can't open file %s to copy data out\n", job->path);
+    	    exit(1);
+    	}
+    	copy_out_file(fd, job->cluster, job->size, checksum ? &crc : NULL,
+    		      pool.image_fd, pool.image_buf, pool.bpb);
+    }
+    /* -C can't be used with -r, so there's nothing to check against */
+    if (checksum)
+    	print_digest(job->path, crc);
+    close(fd);
+}
+
+void *copy_worker(void *arg)
+{
+    while (1) {
+    	struct copy_job *job;
+
+    	pthread_mutex_lock(&pool.lock);
+    	while (pool.head == NULL && !pool.closing)
+    	    pthread_cond_wait(&pool.ready, &pool.lock);
+    	job = pool.head;
+    	if (job != NULL) {
+    	    pool.head = job->next;
+    	    if (pool.head == NULL)
+    		pool.tail = NULL;
+    	}
+    	pthread_mutex_unlock(&pool.lock);
+
+    	if (job == NULL)
+    	    return NULL;     // closing, and nothing left to do
+    	run_job(job);
+    	if (pool.copy_in) {
+    	    pthread_mutex_lock(&pool.lock);
+    	    job->next = pool.done;
+    	    pool.done = job;
+    	    pthread_mutex_unlock(&pool.lock);
+    	}
+    	else
+    	    free(job);
+    }
+}
+
+void pool_start(int nthreads, int copy_in, int image_fd,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    int i;
+
+    pool.copy_in = copy_in;
+    pool.image_fd = image_fd;
+    pool.image_buf = image_buf;
+    pool.bpb = bpb;
+    pool.nthreads = nthreads;
+    pool.threads = malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++) {
+    	if (pthread_create(&pool.threads[i], NULL, copy_worker, NULL) != 0) {
+    	    fprintf(stderr, "Can't start worker thread\n");
+    	    exit(1);
+    	}
+    }
+}
+
+void pool_submit(struct copy_job *job)
+{
+    job->next = NULL;
+    pthread_mutex_lock(&pool.lock);
+    if (pool.tail)
+    	pool.tail->next = job;
+    else
+    	pool.head = job;
+    pool.tail = job;
+    pthread_cond_signal(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* pool_finish waits for the queue to drain and the workers to exit.
+   Calling it again does nothing */
+
+void pool_finish()
+{
+    int i;
+
+    if (pool.finished)
+    	return;
+    pool.finished = TRUE;
+    pthread_mutex_lock(&pool.lock);
+    pool.closing = TRUE;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.nthreads; i++)
+    	pthread_join(pool.threads[i], NULL);
+    free(pool.threads);
+}
+
+/* join_path puts dir/name in path, complaining if it won't fit */
+
+void join_path(char *path, char *dir, char *name)
+{
+    if (snprintf(path, MAXPATHLEN + 1, "%s/%s", dir, name) > MAXPATHLEN) {
+    	fprintf(stderr, "Path %s/%s is too long\n", dir, name);
+    	exit(1);
+    }
+}
+
+/* copyout_tree recreates the image directory starting at cluster as
+   the host directory hostdir, queueing each file in it for the
+   workers */
+
+void copyout_tree(uint16_t cluster, char *hostdir,
+		  uint8_t *image_buf, struct bpb33* bpb)
+{
+    int per_cluster = bpb->bpbBytesPerSec * bpb->bpbSecPerClust / sizeof(struct direntry);
+    struct chain_walk w;
+
+    if (mkdir(hostdir, 0777) < 0 && errno != EEXIST) {
+    	fprintf(stderr, "Can't create directory %s: %s\n", hostdir, strerror(errno));
+    	exit(1);
+    }
+
+    chain_walk_init(&w, cluster, image_buf, bpb);
+    while (cluster == MSDOSFSROOT || chain_walk_next(&w, &cluster)) {
+    	struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    	int nslots = cluster == MSDOSFSROOT ? bpb->bpbRootDirEnts : per_cluster;
+    	int i;
+
+    	for (i = 0; i < nslots; i++, dirent++) {
+    	    char name[MAXFILENAME], path[MAXPATHLEN + 1];
+
+    	    if (dirent->deName[0] == SLOT_EMPTY)
+    		return;
+    	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.')
+    		continue;
+    	    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+    		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+    		continue;
+
+    	    get_name(name, dirent);
+    	    join_path(path, hostdir, name);
+    	    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+    		// don't deal with hidden directories; MacOS makes these
+    		// for trash directories and such; just ignore them.
+    		if ((dirent->deAttributes & ATTR_HIDDEN) == 0)
+    		    copyout_tree(getushort(dirent->deStartCluster), path,
+    				 image_buf, bpb);
+    	    }
+    	    else {
+    		struct copy_job *job = calloc(1, sizeof(struct copy_job));
+    		strcpy(job->path, path);
+    		job->cluster = getushort(dirent->deStartCluster);
+    		job->size = getulong(dirent->deFileSize);
+    		pool_submit(job);
+    	    }
+    	}
+
+    	if (cluster == MSDOSFSROOT)
+    	    return;
+    }
+    chain_walk_check(&w, hostdir);
+}
+
+/* a directory copyin_tree is building in the image.  All of its
+   clusters are reserved when it is created, so entries are simply
+   appended */
+
+struct new_dir {
+    struct extent *runs;
+    int nruns;
+    int nslots;                 /* entries written so far */
+};
+
+/* new_dir_slot returns the address of entry n of dir */
+
+struct direntry *new_dir_slot(struct new_dir *dir, int n,
+			      uint8_t *image_buf, struct bpb33* bpb)
+{
+    int per_cluster = bpb->bpbBytesPerSec * bpb->bpbSecPerClust / sizeof(struct direntry);
+    int c = n / per_cluster;
+    int i = 0;
+
+    while (c >= dir->runs[i].len)
+    	c -= dir->runs[i++].len;
+    return (struct direntry*)cluster_to_addr(dir->runs[i].start + c, image_buf, bpb)
+    	+ n % per_cluster;
+}
+
+/* new_dir_add appends an entry to dir, unless its 8.3 name is already
+   taken there, in which case it returns NULL */
+
+struct direntry *new_dir_add(struct new_dir *dir, char *filename, uint8_t attr,
+			     uint16_t start, uint32_t size,
+			     uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent = new_dir_slot(dir, dir->nslots, image_buf, bpb);
+    int i;
+
+    write_dirent(dirent, filename, attr, start, size);
+    for (i = 0; i < dir->nslots; i++) {
+    	struct direntry *other = new_dir_slot(dir, i, image_buf, bpb);
+    	if (memcmp(other->deName, dirent->deName, 8) == 0
+    	    && memcmp(other->deExtension, dirent->deExtension, 3) == 0) {
+    	    memset(dirent, 0, sizeof(struct direntry));
+    	    return NULL;
+    	}
+    }
+    dir->nslots++;
+    return dirent;
+}
+
+/* write_dot_entry fills in one of the "." and ".." entries that start
+   every subdirectory */
+
+void write_dot_entry(struct direntry *dirent, char *name, uint16_t cluster)
+{
+    memset(dirent, 0, sizeof(struct direntry));
+    memset(dirent->deName, ' ', 8);
+    memset(dirent->deExtension, ' ', 3);
+    memcpy(dirent->deName, name, strlen(name));
+    dirent->deAttributes = ATTR_DIRECTORY;
+    putushort(dirent->deStartCluster, cluster);
+}
+
+/* Everything a recursive copy-in has reserved so far.  If it has to
+   stop part way - out of space, or a host file it can't look at - the
+   new tree is taken back out of the image, rather than left half made
+   with entries that point nowhere */
+static struct extent *reserved;
+static int nreserved, reserved_alloced;
+static struct direntry *new_tree;      /* the new directory's entry */
+static uint16_t new_tree_parent;       /* and the directory it's in */
+
+void note_reserved(struct extent *runs, int nruns)
+{
+    int i;
+
+    for (i = 0; i < nruns; i++) {
+    	if (nreserved == reserved_alloced) {
+    	    reserved_alloced = reserved_alloced ? reserved_alloced * 2 : 64;
+    	    reserved = realloc(reserved, reserved_alloced * sizeof(struct extent));
+    	}
+    	reserved[nreserved++] = runs[i];
+    }
+}
+
+/* abandon_tree waits for the workers, frees every chain the copy
+   reserved, deletes the new directory's entry and stops.  It's only
+   called on the main thread */
+
+void abandon_tree(uint8_t *image_buf, struct bpb33* bpb)
+{
+    int i;
+
+    pool_finish();
+    for (i = 0; i < nreserved; i++)
+    	freemap_release(reserved[i].start, reserved[i].len, image_buf, bpb);
+    new_tree->deName[0] = SLOT_DELETED;
+    dir_hint_forget(new_tree_parent);
+    exit(1);
+}
+
+/* settle_jobs waits for the workers to finish the copy in, then goes
+   over what they did.  If any file couldn't be read the whole tree is
+   taken back out; a file that shrank has its chain cut down and its
+   size put right */
+
+void settle_jobs(uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct copy_job *job;
+
+    pool_finish();
+    for (job = pool.done; job != NULL; job = job->next)
+    	if (job->failed)
+    	    abandon_tree(image_buf, bpb);
+    while ((job = pool.done) != NULL) {
+    	pool.done = job->next;
+    	if (job->got < job->size) {
+    	    trim_chain(job->runs, job->nruns, job->got, image_buf, bpb);
+    	    if (job->got == 0)
+    		putushort(job->dirent->deStartCluster, 0);
+    	    putulong(job->dirent->deFileSize, job->got);
+    	}
+    	free(job->runs);
+    	free(job);
+    }
+}
+
+int by_name(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* copyin_tree copies the host directory hostdir into the image as the
+   directory entry dirent, in the directory starting at parent_cluster.
+   The new directory is created with room for every entry in hostdir;
+   each file in it gets its chain reserved, then its entry written
+   here, and is then queued for the workers to fill in */
+
+void copyin_tree(char *hostdir, struct direntry *dirent, uint16_t parent_cluster,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    struct new_dir dir;
+    struct dirent *de;
+    char **names = NULL;
+    int count = 0, alloced = 0, i;
+    uint16_t cluster;
+    DIR *d;
+
+    d = opendir(hostdir);
+    if (d == NULL) {
+    	fprintf(stderr, "Can't read directory %s: %s\n", hostdir, strerror(errno));
+    	abandon_tree(image_buf, bpb);
+    }
+    while ((de = readdir(d)) != NULL) {
+    	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+    	    continue;
+    	if (count == alloced) {
+    	    alloced = alloced ? alloced * 2 : 16;
+    	    names = realloc(names, alloced * sizeof(char*));
+    	}
+    	names[count++] = strdup(de->d_name);
+    }
+    closedir(d);
+    qsort(names, count, sizeof(char*), by_name);
+
+    /* make the directory, with room for "." and ".." too */
+    dir.nruns = alloc_chain((count + 2) * sizeof(struct direntry), &dir.runs,
+    			    image_buf, bpb);
+    if (dir.nruns < 0)
+    	abandon_tree(image_buf, bpb);
+    note_reserved(dir.runs, dir.nruns);
+    for (i = 0; i < dir.nruns; i++)
+    	memset(cluster_to_addr(dir.runs[i].start, image_buf, bpb), 0,
+    	       dir.runs[i].len * clust_size);
+    cluster = dir.runs[0].start;
+    putushort(dirent->deStartCluster, cluster);
+    write_dot_entry(new_dir_slot(&dir, 0, image_buf, bpb), ".", cluster);
+    write_dot_entry(new_dir_slot(&dir, 1, image_buf, bpb), "..", parent_cluster);
+    dir.nslots = 2;
+
+    for (i = 0; i < count; i++) {
+    	char path[MAXPATHLEN + 1];
+    	struct direntry *child;
+    	struct extent *runs = NULL;
+    	struct stat st;
+    	int nruns = 0, k;
+
+    	join_path(path, hostdir, names[i]);
+    	if (lstat(path, &st) < 0) {
+    	    fprintf(stderr, "Can't stat %s: %s\n", path, strerror(errno));
+    	    abandon_tree(image_buf, bpb);
+    	}
+    	if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+    	    fprintf(stderr, "Skipping %s: not a regular file or directory\n", path);
+    	    continue;
+    	}
+    	if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX) {
+    	    fprintf(stderr, "Skipping %s: too big for a FAT filesystem\n", path);
+    	    continue;
+    	}
+
+    	/* a file's chain is reserved first, so its entry is written
+    	   with its start and size together */
+    	if (S_ISREG(st.st_mode)) {
+    	    nruns = alloc_chain(st.st_size, &runs, image_buf, bpb);
+    	    if (nruns < 0)
+    		abandon_tree(image_buf, bpb);
+    	}
+    	child = new_dir_add(&dir, names[i],
+    			    S_ISDIR(st.st_mode) ? ATTR_DIRECTORY : ATTR_NORMAL,
+    			    nruns > 0 ? runs[0].start : 0,
+    			    S_ISDIR(st.st_mode) ? 0 : st.st_size, image_buf, bpb);
+    	if (child == NULL) {
+    	    fprintf(stderr, "Skipping %s: its 8.3 name is already taken\n", path);
+    	    for (k = 0; k < nruns; k++)
+    		freemap_release(runs[k].start, runs[k].len, image_buf, bpb);
+    	    free(runs);
+    	    continue;
+    	}
+
+    	if (S_ISDIR(st.st_mode))
+    	    copyin_tree(path, child, cluster, image_buf, bpb);
+    	else if (nruns > 0) {
+    	    struct copy_job *job = calloc(1, sizeof(struct copy_job));
+    	    strcpy(job->path, path);
+    	    job->size = st.st_size;
+    	    job->runs = runs;
+    	    job->nruns = nruns;
+    	    job->dirent = child;
+    	    note_reserved(runs, nruns);
+    	    pool_submit(job);
+    	}
+    }
+
+    for (i = 0; i < count; i++)
+    	free(names[i]);
+    free(names);
+    free(dir.runs);
+}
+
+/* copyout_dir copies the directory infilename in the disk image, and
+   everything under it, to the host directory outdirname */
+
+void copyout_dir(char *infilename, char *outdirname,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t cluster = MSDOSFSROOT;
+
+    assert(strncmp("a:", infilename, 2) == 0);
+    infilename += 2;
+    while (*infilename == '/' || *infilename == '\\')
+    	infilename++;
+
+    if (*infilename != '\0') {
+    	struct direntry *dirent = find_file(infilename, 0, FIND_ANY, image_buf, bpb);
+    	if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0) {
+    	    fprintf(stderr, "No directory called %s exists in the disk image\n",
+    		    infilename);
+    	    exit(1);
+    	}
+    	cluster = getushort(dirent->deStartCluster);
+    }
+
+    copyout_tree(cluster, outdirname, image_buf, bpb);
+}
+
+/* copyin_dir copies the host directory indirname, and everything under
+   it, into the disk image as a new directory outfilename */
+
+void copyin_dir(char *indirname, char *outfilename,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    uint16_t parent_cluster;
+    struct stat st;
+
+    assert(strncmp("a:", outfilename, 2) == 0);
+    outfilename += 2;
+
+    if (stat(indirname, &st) < 0 || !S_ISDIR(st.st_mode)) {
+    	fprintf(stderr, "%s is not a directory\n", indirname);
+    	exit(1);
+    }
+
+    /* check that nothing by that name already exists */
+    if (find_file(outfilename, 0, FIND_ANY, image_buf, bpb) != NULL) {
+    	fprintf(stderr, "File %s already exists\n", outfilename);
+    	exit(1);
+    }
+
+    /* find the directory to put the new one in */
+    parent_cluster = find_parent_dir(outfilename, image_buf, bpb);
+    dirent = create_dirent(parent_cluster, outfilename, ATTR_DIRECTORY, 0, 0,
+    			   image_buf, bpb);
+    if (dirent == NULL) {
+    	fprintf(stderr, "No room for %s in its directory\n", outfilename);
+    	exit(1);
+    }
+    new_tree = dirent;
+    new_tree_parent = parent_cluster;
+    copyin_tree(indirname, dirent, parent_cluster, image_buf, bpb);
+    settle_jobs(image_buf, bpb);
 }
 
 void usage(char *progname)
@@ -432,27 +1392,106 @@ void usage(char *progname)
     fprintf(stderr, "\tcopies file called filename1 from disk image to a normal file\n");
     fprintf(stderr, "usage: %s <imagename> <filename3> a:<filename4>\n", progname);
     fprintf(stderr, "\tcopies normal file called filename3 into disk image as filename4\n");
+    fprintf(stderr, "usage: %s -u <imagename> <filename3> a:<filename4>\n", progname);
+    fprintf(stderr, "\tas above, but if filename4 exists only rewrites the clusters that changed\n");
+    fprintf(stderr, "usage: %s -r [-j <threads>] <imagename> a:<dir1> <dir2>\n", progname);
+    fprintf(stderr, "usage: %s -r [-j <threads>] <imagename> <dir3> a:<dir4>\n", progname);
+    fprintf(stderr, "\tcopies a whole directory tree out of or into the disk image,\n");
+    fprintf(stderr, "\tmoving file data on <threads> threads (default: one per CPU)\n");
+    fprintf(stderr, "copying out, -s leaves all-zero clusters as holes in the output,\n");
+    fprintf(stderr, "and -z does the same and reports how much of the data was zero\n");
+    fprintf(stderr, "-c prints the CRC32C of each file copied, and -C <crc> checks\n");
+    fprintf(stderr, "that a single file copied has that CRC32C\n");
     exit(1);
 }
 
+/* parse_crc reads the CRC32C given with -C: up to eight hex digits */
+
+uint32_t parse_crc(char *arg, char *progname)
+{
+    char *end;
+    uint32_t crc = strtoul(arg, &end, 16);
+
+    if (!isxdigit((unsigned char)*arg) || *end != '\0' || strlen(arg) > 8)
+    	usage(progname);
+    return crc;
+}
+
 int main(int argc, char** argv)
 {
-    int fd;
+    int fd, c;
     uint8_t *image_buf;
     struct bpb33* bpb;
-    if (argc < 4 || argc > 4)
+    int recursive = FALSE;
+    int update = FALSE;
+    int report_zeros = FALSE;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *progname = argv[0];
+
+    while ((c = getopt(argc, argv, "rj:uszcC:")) != -1) {
+    	switch (c) {
+    	case 'r':
+    	    recursive = TRUE;
+    	    break;
+    	case 'u':
+    	    update = TRUE;
+    	    break;
+    	case 'z':
+    	    report_zeros = TRUE;
+    	    /* fall through */
+    	case 's':
+    	    sparse = TRUE;
+    	    break;
+    	case 'C':
+    	    expected_crc = parse_crc(optarg, argv[0]);
+    	    have_expected = TRUE;
+    	    /* fall through */
+    	case 'c':
+    	    checksum = TRUE;
+    	    break;
+    	case 'j':
+    	    nthreads = atoi(optarg);
+    	    if (nthreads < 1)
+    		usage(argv[0]);
+    	    break;
+    	default:
+    	    usage(argv[0]);
+    	}
+    }
+    if (argc - optind != 3 || (recursive && (update || have_expected)))
     	usage(argv[0]);
+    if (nthreads < 1)
+    	nthreads = 1;
+
+    /* from here on, argv[1] is the image name */
+    argv += optind - 1;
 
     image_buf = mmap_file(argv[1], &fd);
     bpb = check_bootsector(image_buf);
 
     /* use the "a:" bit to determine whether we're copying in or out */
-    if (strncmp("a:", argv[2], 2)==0)
-    	copyout(argv[2], argv[3], image_buf, bpb); // copy from FAT-12 disk image to external filesystem
+    if (recursive) {
+    	int copy_in = strncmp("a:", argv[2], 2) != 0;
+    	if (copy_in && strncmp("a:", argv[3], 2) != 0)
+    	    usage(progname);
+    	pool_start(nthreads, copy_in, fd, image_buf, bpb);
+    	if (copy_in)
+    	    copyin_dir(argv[2], argv[3], image_buf, bpb);
+    	else
+    	    copyout_dir(argv[2], argv[3], image_buf, bpb);
+    	pool_finish();
+    }
+    else if (strncmp("a:", argv[2], 2)==0)
+    	copyout(argv[2], argv[3], fd, image_buf, bpb); // copy from FAT-12 disk image to external filesystem
     else if (strncmp("a:", argv[3], 2)==0)
-    	copyin(argv[2], argv[3], image_buf, bpb);  // copy from external filesystem to FAT-12 disk image
+    	copyin(argv[2], argv[3], update, image_buf, bpb);  // copy from external filesystem to FAT-12 disk image
     else
-    	usage(argv[0]);
+    	usage(progname);
+
+    if (report_zeros && total_clusters > 0)
+    	fprintf(stderr, "%u of %u clusters were zero (%.1f%%)\n",
+    		zero_clusters, total_clusters,
+    		100.0 * zero_clusters / total_clusters);
 
     unmmap_file(image_buf, &fd);
     return 0;
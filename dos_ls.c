@@ -110,9 +110,19 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
 }
 
 
-void follow_dir(uint16_t cluster, int indent, uint8_t *image_buf, struct bpb33* bpb)
+/* the directories follow_dir is inside, so a loop stops the listing */
+static struct dir_trail trail;
+
+void follow_dir(uint16_t start, int indent, uint8_t *image_buf, struct bpb33* bpb)
 {
-    while (is_valid_cluster(cluster, bpb))
+    struct chain_walk w;
+    uint16_t cluster;
+    char what[32];
+
+    dir_trail_enter(&trail, start, NULL);
+
+    chain_walk_init(&w, start, image_buf, bpb);
+    while (chain_walk_next(&w, &cluster))
     {
         struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
 
@@ -126,9 +136,10 @@ void follow_dir(uint16_t cluster, int indent, uint8_t *image_buf, struct bpb33*
 					follow_dir(followclust, indent+1, image_buf, bpb);
 				dirent++;
 		}
-
-		cluster = get_fat_entry(cluster, image_buf, bpb);
     }
+    snprintf(what, sizeof(what), "directory at cluster %u", start);
+    chain_walk_check(&w, what);
+    dir_trail_leave(&trail);
 }
 
 
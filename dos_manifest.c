@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* one file in an image */
+struct mf_file {
+    char path[MAXPATHLEN + 1];
+    uint16_t start;
+    uint32_t size;
+    uint32_t crc;
+    struct extent *runs;        /* the chain, filled in by a worker */
+    int nruns;
+};
+
+/* every file in one image, sorted by path once the walk is done */
+struct manifest {
+    struct mf_file *files;
+    int nfiles;
+    int alloced;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+};
+
+/* a piece of work for the threads: hash a, or if b isn't NULL, find
+   out whether a and b have the same contents */
+struct mf_task {
+    struct mf_file *a, *b;
+    int same;
+};
+
+static struct mf_task *tasks;
+static int ntasks;
+static int next_task = 0;
+static struct manifest *image_a, *image_b;
+
+/* the directories walk_dir is inside, so a loop stops the walk */
+static struct dir_trail trail;
+
+
+/* walk_dir adds every file below the directory starting at cluster to
+   m, with their paths starting with prefix.  The caller puts the
+   directory on the trail first */
+void walk_dir(struct manifest *m, uint16_t cluster, char *prefix)
+{
+    uint32_t clust_size = m->bpb->bpbBytesPerSec * m->bpb->bpbSecPerClust;
+    struct chain_walk w;
+
+    chain_walk_init(&w, cluster, m->image_buf, m->bpb);
+    while (cluster == MSDOSFSROOT || chain_walk_next(&w, &cluster)) {
+    	struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, m->image_buf, m->bpb);
+    	int nslots = cluster == MSDOSFSROOT ? m->bpb->bpbRootDirEnts
+    	    : (int)(clust_size / sizeof(struct direntry));
+    	int i;
+
+    	for (i = 0; i < nslots; i++, dirent++) {
+    	    char name[MAXFILENAME];
+    	    char path[MAXPATHLEN + 1];
+
+    	    if (dirent->deName[0] == SLOT_EMPTY)
+    		return;
+    	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+    		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+    		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+    		continue;
+
+    	    dirent_name(name, dirent);
+    	    snprintf(path, sizeof(path), "%s%s", prefix, name);
+    	    if (dirent->deAttributes & ATTR_DIRECTORY) {
+    		strncat(path, "/", MAXPATHLEN - strlen(path));
+    		dir_trail_enter(&trail, getushort(dirent->deStartCluster), path);
+    		walk_dir(m, getushort(dirent->deStartCluster), path);
+    		dir_trail_leave(&trail);
+    		continue;
+    	    }
+
+    	    if (m->nfiles == m->alloced) {
+    		m->alloced = m->alloced ? m->alloced * 2 : 64;
+    		m->files = realloc(m->files, m->alloced * sizeof(struct mf_file));
+    	    }
+    	    memset(&m->files[m->nfiles], 0, sizeof(struct mf_file));
+    	    strcpy(m->files[m->nfiles].path, path);
+    	    m->files[m->nfiles].start = getushort(dirent->deStartCluster);
+    	    m->files[m->nfiles].size = getulong(dirent->deFileSize);
+    	    m->nfiles++;
+    	}
+    	if (cluster == MSDOSFSROOT)
+    	    return;
+    }
+    chain_walk_check(&w, prefix);
+}
+
+int by_path(const void *a, const void *b)
+{
+    return strcmp(((struct mf_file *)a)->path, ((struct mf_file *)b)->path);
+}
+
+/* load_manifest maps the image filename and lists all of its files */
+struct manifest *load_manifest(char *filename, int *fd)
+{
+    struct manifest *m = calloc(1, sizeof(struct manifest));
+
+    m->image_buf = mmap_file(filename, fd);
+    m->bpb = check_bootsector(m->image_buf);
+    dir_trail_enter(&trail, MSDOSFSROOT, "/");
+    walk_dir(m, MSDOSFSROOT, "");
+    dir_trail_leave(&trail);
+    qsort(m->files, m->nfiles, sizeof(struct mf_file), by_path);
+    return m;
+}
+
+
+/* get_runs records the extents of f's chain, as far as its size
+   needs.  A chain that stops short just gives fewer runs; one that
+   loops stops the manifest */
+void get_runs(struct manifest *m, struct mf_file *f)
+{
+    uint32_t clust_size = m->bpb->bpbBytesPerSec * m->bpb->bpbSecPerClust;
+    uint32_t need = (f->size + clust_size - 1) / clust_size;
+    uint16_t cluster, len;
+    struct chain_walk w;
+    int alloced = 0;
+
+    if (f->runs != NULL)
+    	return;
+    chain_walk_init(&w, f->start, m->image_buf, m->bpb);
+    while (need > 0 && chain_walk_extent(&w, &cluster, &len)) {
+    	if (len > need)
+    	    len = need;
+    	if (f->nruns == alloced) {
+    	    alloced = alloced ? alloced * 2 : 4;
+    	    f->runs = realloc(f->runs, alloced * sizeof(struct extent));
+    	}
+    	f->runs[f->nruns].start = cluster;
+    	f->runs[f->nruns].len = len;
+    	f->nruns++;
+    	need -= len;
+    }
+    chain_walk_check(&w, f->path);
+}
+
+/* hash_file fills in the CRC32C of f's contents */
+void hash_file(struct manifest *m, struct mf_file *f)
+{
+    uint32_t clust_size = m->bpb->bpbBytesPerSec * m->bpb->bpbSecPerClust;
+    uint32_t remaining = f->size;
+    int i;
+
+    get_runs(m, f);
+    f->crc = 0;
+    for (i = 0; i < f->nruns && remaining > 0; i++) {
+    	uint32_t len = f->runs[i].len * clust_size;
+    	if (len > remaining)
+    	    len = remaining;
+    	f->crc = crc32c(f->crc, cluster_to_addr(f->runs[i].start, m->image_buf, m->bpb), len);
+    	remaining -= len;
+    }
+}
+
+/* same_contents compares two files of the same size straight out of
+   the two mappings, a piece at a time where their extents overlap */
+int same_contents(struct mf_file *a, struct mf_file *b)
+{
+    uint32_t csa = image_a->bpb->bpbBytesPerSec * image_a->bpb->bpbSecPerClust;
+    uint32_t csb = image_b->bpb->bpbBytesPerSec * image_b->bpb->bpbSecPerClust;
+    uint32_t remaining = a->size, off_a = 0, off_b = 0;
+    int ia = 0, ib = 0;
+
+    get_runs(image_a, a);
+    get_runs(image_b, b);
+    while (remaining > 0) {
+    	uint32_t left_a, left_b, len;
+    	uint8_t *pa, *pb;
+
+    	if (ia == a->nruns || ib == b->nruns)
+    	    return FALSE;     // one of the chains is too short
+    	left_a = a->runs[ia].len * csa - off_a;
+    	left_b = b->runs[ib].len * csb - off_b;
+    	len = left_a < left_b ? left_a : left_b;
+    	if (len > remaining)
+    	    len = remaining;
+
+    	pa = cluster_to_addr(a->runs[ia].start, image_a->image_buf, image_a->bpb) + off_a;
+    	pb = cluster_to_addr(b->runs[ib].start, image_b->image_buf, image_b->bpb) + off_b;
+    	if (memcmp(pa, pb, len) != 0)
+    	    return FALSE;
+
+    	remaining -= len;
+    	off_a += len;
+    	off_b += len;
+    	if (off_a == a->runs[ia].len * csa) {
+    	    ia++;
+    	    off_a = 0;
+    	}
+    	if (off_b == b->runs[ib].len * csb) {
+    	    ib++;
+    	    off_b = 0;
+    	}
+    }
+    return TRUE;
+}
+
+/* worker takes tasks off the shared list until there are none left.
+   Everything it touches in the images is only read */
+void *worker(void *arg)
+{
+    int i;
+
+    while ((i = __atomic_fetch_add(&next_task, 1, __ATOMIC_RELAXED)) < ntasks) {
+    	struct mf_task *t = &tasks[i];
+
+    	if (t->b == NULL) {
+    	    hash_file(image_a, t->a);
+    	    continue;
+    	}
+    	/* byte-identical files don't need hashing at all */
+    	if (t->a->size == t->b->size && same_contents(t->a, t->b)) {
+    	    t->same = TRUE;
+    	    continue;
+    	}
+    	hash_file(image_a, t->a);
+    	hash_file(image_b, t->b);
+    }
+    return NULL;
+}
+
+/* run_tasks works through the task list on nthreads threads */
+void run_tasks(int nthreads)
+{
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    int i;
+
+    for (i = 0; i < nthreads; i++)
+    	if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+    	    fprintf(stderr, "Can't start a worker thread\n");
+    	    exit(1);
+    	}
+    for (i = 0; i < nthreads; i++)
+    	pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+
+/* print_manifest writes one line per file: its CRC32C, size, path and
+   the extents of its chain as start+length */
+void print_manifest(struct manifest *m)
+{
+    int i, j;
+
+    for (i = 0; i < m->nfiles; i++) {
+    	struct mf_file *f = &m->files[i];
+    	printf("%08x %10u %s ", f->crc, f->size, f->path);
+    	if (f->nruns == 0)
+    	    printf("-");
+    	for (j = 0; j < f->nruns; j++)
+    	    printf("%s%u+%u", j ? "," : "", f->runs[j].start, f->runs[j].len);
+    	printf("\n");
+    }
+}
+
+/* diff_tasks pairs up the files of the two images by path.  Files in
+   only one of them are reported straight away; the pairs become tasks.
+   Returns the number of files that are only on one side */
+int diff_tasks(void)
+{
+    int ia = 0, ib = 0, lonely = 0;
+
+    tasks = malloc((image_a->nfiles + 1) * sizeof(struct mf_task));
+    ntasks = 0;
+    while (ia < image_a->nfiles || ib < image_b->nfiles) {
+    	int cmp;
+
+    	if (ia == image_a->nfiles)
+    	    cmp = 1;
+    	else if (ib == image_b->nfiles)
+    	    cmp = -1;
+    	else
+    	    cmp = strcmp(image_a->files[ia].path, image_b->files[ib].path);
+
+    	if (cmp < 0) {
+    	    printf("- %s\n", image_a->files[ia++].path);
+    	    lonely++;
+    	}
+    	else if (cmp > 0) {
+    	    printf("+ %s\n", image_b->files[ib++].path);
+    	    lonely++;
+    	}
+    	else {
+    	    tasks[ntasks].a = &image_a->files[ia++];
+    	    tasks[ntasks].b = &image_b->files[ib++];
+    	    tasks[ntasks].same = FALSE;
+    	    ntasks++;
+    	}
+    }
+    return lonely;
+}
+
+/* print_diff reports the pairs whose contents differ, with the size
+   and CRC32C of each side, and returns how many there were */
+int print_diff(void)
+{
+    int i, changed = 0;
+
+    for (i = 0; i < ntasks; i++) {
+    	struct mf_file *a = tasks[i].a, *b = tasks[i].b;
+    	if (tasks[i].same)
+    	    continue;
+    	printf("M %s %u %08x %u %08x\n", a->path, a->size, a->crc, b->size, b->crc);
+    	changed++;
+    }
+    return changed;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-j <threads>] <imagename>\n", progname);
+    fprintf(stderr, "\tlists every file in the disk image with its CRC32C, size,\n");
+    fprintf(stderr, "\tpath and cluster extents\n");
+    fprintf(stderr, "usage: %s -d [-j <threads>] <imagename1> <imagename2>\n", progname);
+    fprintf(stderr, "\tlists the files that are only in imagename1 (-), only in\n");
+    fprintf(stderr, "\timagename2 (+), or in both with different contents (M);\n");
+    fprintf(stderr, "\texits with 1 if there were any differences\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    int fd_a, fd_b = -1, c, i;
+    int diff = FALSE, differences = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *progname = argv[0];
+
+    while ((c = getopt(argc, argv, "dj:")) != -1) {
+    	switch (c) {
+    	case 'd':
+    	    diff = TRUE;
+    	    break;
+    	case 'j':
+    	    nthreads = atoi(optarg);
+    	    if (nthreads < 1)
+    		usage(progname);
+    	    break;
+    	default:
+    	    usage(progname);
+    	}
+    }
+    if (argc - optind != (diff ? 2 : 1))
+    	usage(progname);
+    if (nthreads < 1)
+    	nthreads = 1;
+
+    /* from here on, argv[1] is the (first) image name */
+    argv += optind - 1;
+
+    image_a = load_manifest(argv[1], &fd_a);
+    if (diff) {
+    	image_b = load_manifest(argv[2], &fd_b);
+    	differences = diff_tasks();
+    }
+    else {
+    	tasks = malloc((image_a->nfiles + 1) * sizeof(struct mf_task));
+    	ntasks = image_a->nfiles;
+    	for (i = 0; i < ntasks; i++) {
+    	    tasks[i].a = &image_a->files[i];
+    	    tasks[i].b = NULL;
+    	}
+    }
+
+    if (nthreads > ntasks)
+    	nthreads = ntasks > 0 ? ntasks : 1;
+    run_tasks(nthreads);
+
+    if (diff)
+    	differences += print_diff();
+    else
+    	print_manifest(image_a);
+
+    if (diff)
+    	unmmap_file(image_b->image_buf, &fd_b);
+    unmmap_file(image_a->image_buf, &fd_a);
+    return differences > 0 ? 1 : 0;
+}
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+/* what to do with the contents of clusters we free */
+#define SCRUB_NONE 0     // leave the old data where it was
+#define SCRUB_ZERO 1     // overwrite it with zeros
+#define SCRUB_DISCARD 2  // punch a hole in the image file
+
+static int scrub_mode = SCRUB_NONE;
+static int image_fd = -1;
+
+
+/* scrub_run zeroes or discards len clusters starting at start.  If the
+   image's filesystem can't punch holes we fall back to zeroing */
+static void scrub_run(uint16_t start, uint16_t len,
+    		      uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint8_t *p = cluster_to_addr(start, image_buf, bpb);
+
+    if (scrub_mode == SCRUB_DISCARD
+    	&& fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+    		     p - image_buf, (off_t)len * clust_size) == 0)
+    	return;
+    memset(p, 0, (size_t)len * clust_size);
+}
+
+
+/* release_chain frees every cluster in the chain starting at cluster,
+   one extent at a time, scrubbing the data first if we were asked to.
+   Returns the number of clusters freed */
+static uint32_t release_chain(uint16_t cluster,
+    			      uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t freed = 0;
+    uint16_t start, len;
+    struct chain_walk w;
+
+    if (scrub_mode == SCRUB_NONE)
+    	return free_chain(cluster, image_buf, bpb);
+
+    chain_walk_init(&w, cluster, image_buf, bpb);
+    while (chain_walk_extent(&w, &start, &len)) {
+    	scrub_run(start, len, image_buf, bpb);
+    	freemap_release(start, len, image_buf, bpb);
+    	freed += len;
+    }
+    return freed;
+}
+
+
+/* delete_dirent marks a directory entry as deleted.  dir is the first
+   cluster of the directory holding it, whose free slot hint is now out
+   of date */
+static void delete_dirent(struct direntry *dirent, uint16_t dir)
+{
+    dirent->deName[0] = SLOT_DELETED;
+    dir_hint_forget(dir);
+}
+
+
+/* the directories remove_tree is inside, so a loop stops it */
+static struct dir_trail trail;
+
+/* remove_tree frees everything below the directory starting at
+   cluster, then the directory's own clusters */
+static uint32_t remove_tree(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t freed = 0;
+    uint16_t dir = cluster;
+    struct chain_walk w;
+
+    dir_trail_enter(&trail, dir, NULL);
+
+    chain_walk_init(&w, dir, image_buf, bpb);
+    while (chain_walk_next(&w, &cluster)) {
+    	struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    	int i;
+
+    	for (i = 0; i < (int)(clust_size / sizeof(struct direntry)); i++, dirent++) {
+    	    uint16_t start = getushort(dirent->deStartCluster);
+
+    	    if (dirent->deName[0] == SLOT_EMPTY)
+    		break;
+    	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+    		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+    		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+    		continue;
+    	    if (dirent->deAttributes & ATTR_DIRECTORY)
+    		freed += remove_tree(start, image_buf, bpb);
+    	    else
+    		freed += release_chain(start, image_buf, bpb);
+    	    dirent->deName[0] = SLOT_DELETED;
+    	}
+    	if (i < (int)(clust_size / sizeof(struct direntry)))
+    	    break;
+    }
+    dir_trail_leave(&trail);
+    dir_hint_forget(dir);
+    return freed + release_chain(dir, image_buf, bpb);
+}
+
+
+/* truncate_file cuts a file down to length bytes, freeing the clusters
+   it no longer needs.  The unused end of the new last cluster is zeroed
+   so growing the file later can't bring the old data back */
+static uint32_t truncate_file(struct direntry *dirent, uint32_t length,
+    			      uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t size = getulong(dirent->deFileSize);
+    uint32_t keep = (length + clust_size - 1) / clust_size;
+    uint16_t start = getushort(dirent->deStartCluster);
+    uint16_t last, next;
+    uint32_t freed;
+
+    if (length > size) {
+    	fprintf(stderr, "Can't grow a file with truncate (it is %u bytes)\n", size);
+    	exit(1);
+    }
+    if (keep == 0) {
+    	putushort(dirent->deStartCluster, 0);
+    	putulong(dirent->deFileSize, 0);
+    	return release_chain(start, image_buf, bpb);
+    }
+
+    /* the size only changes once we know the chain can be cut there */
+    last = chain_nth(start, keep - 1, image_buf, bpb);
+    if (!is_valid_cluster(last, bpb)) {
+    	fprintf(stderr, "File's cluster chain is shorter than its size\n");
+    	exit(1);
+    }
+    next = get_fat_entry(last, image_buf, bpb);
+    set_fat_entry(last, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+    putulong(dirent->deFileSize, length);
+    freed = release_chain(next, image_buf, bpb);
+
+    if (length % clust_size != 0)
+    	memset(cluster_to_addr(last, image_buf, bpb) + length % clust_size, 0,
+    	       clust_size - length % clust_size);
+    return freed;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-r] [-z | -d] <imagename> a:<filename>\n", progname);
+    fprintf(stderr, "\tremoves filename from the disk image; -r removes a directory and\n");
+    fprintf(stderr, "\teverything in it\n");
+    fprintf(stderr, "usage: %s -t <length> [-z | -d] <imagename> a:<filename>\n", progname);
+    fprintf(stderr, "\tshrinks filename to length bytes\n");
+    fprintf(stderr, "\t-z overwrites the freed clusters with zeros, -d discards them\n");
+    fprintf(stderr, "\tfrom the image file instead\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    int fd, c;
+    uint8_t *image_buf;
+    struct bpb33* bpb;
+    struct direntry *dirent;
+    uint16_t parent;
+    int recursive = FALSE;
+    int truncating = FALSE;
+    uint32_t length = 0;
+    char *progname = argv[0];
+
+    while ((c = getopt(argc, argv, "rt:zd")) != -1) {
+    	switch (c) {
+    	case 'r':
+    	    recursive = TRUE;
+    	    break;
+    	case 't':
+    	    if (!parse_size(optarg, &length))
+    		usage(progname);
+    	    truncating = TRUE;
+    	    break;
+    	case 'z':
+    	    scrub_mode = SCRUB_ZERO;
+    	    break;
+    	case 'd':
+    	    scrub_mode = SCRUB_DISCARD;
+    	    break;
+    	default:
+    	    usage(progname);
+    	}
+    }
+    if (argc - optind != 2 || (recursive && truncating))
+    	usage(progname);
+
+    /* from here on, argv[1] is the image name */
+    argv += optind - 1;
+    if (strncmp("a:", argv[2], 2) != 0)
+    	usage(progname);
+
+    image_buf = mmap_file(argv[1], &fd);
+    image_fd = fd;
+    bpb = check_bootsector(image_buf);
+
+    dirent = find_path(argv[2] + 2, &parent, image_buf, bpb);
+    if (dirent == NULL) {
+    	fprintf(stderr, "File not found: %s\n", argv[2]);
+    	exit(1);
+    }
+
+    if (dirent->deAttributes & ATTR_DIRECTORY) {
+    	if (!recursive) {
+    	    fprintf(stderr, "%s is a directory (use -r)\n", argv[2]);
+    	    exit(1);
+    	}
+    	if (dirent->deName[0] == '.') {
+    	    fprintf(stderr, "Can't remove %s\n", argv[2]);
+    	    exit(1);
+    	}
+    	remove_tree(getushort(dirent->deStartCluster), image_buf, bpb);
+    	delete_dirent(dirent, parent);
+    }
+    else if (truncating) {
+    	truncate_file(dirent, length, image_buf, bpb);
+    }
+    else {
+    	release_chain(getushort(dirent->deStartCluster), image_buf, bpb);
+    	delete_dirent(dirent, parent);
+    }
+
+    unmmap_file(image_buf, &fd);
+    return 0;
+}
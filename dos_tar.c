@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK)
+
+/* number of iovecs we gather before handing them to writev */
+#define TAR_IOV_BATCH 64
+
+/* how much of the next file we ask the kernel to start reading while
+   the current one is being written */
+#define READAHEAD_BYTES (256 * 1024)
+
+/* POSIX ustar header; one TAR_BLOCK long */
+struct ustar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+static uint8_t zeros[TAR_BLOCK];
+
+static struct iovec iov[TAR_IOV_BATCH];
+static int niov = 0;
+static uint64_t bytes_out = 0;
+
+static int readahead = FALSE;
+
+
+/* flush_out writes out the batch of iovecs, picking up where it left
+   off after a short write */
+void flush_out()
+{
+    struct iovec *v = iov;
+    int count = niov;
+
+    while (count > 0)
+    {
+        ssize_t n = writev(STDOUT_FILENO, v, count);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        while (count > 0 && (size_t)n >= v->iov_len)
+        {
+            n -= v->iov_len;
+            v++;
+            count--;
+        }
+        if (count > 0)
+        {
+            v->iov_base = (uint8_t*)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    niov = 0;
+}
+
+
+/* emit queues len bytes at p for output.  p must stay valid until the
+   next flush_out() */
+void emit(void *p, size_t len)
+{
+    if (len == 0)
+        return;
+    if (niov == TAR_IOV_BATCH)
+        flush_out();
+    iov[niov].iov_base = p;
+    iov[niov].iov_len = len;
+    niov++;
+    bytes_out += len;
+}
+
+
+/* emit_zeros queues len bytes of zero fill */
+void emit_zeros(size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = len > TAR_BLOCK ? TAR_BLOCK : len;
+        emit(zeros, n);
+        len -= n;
+    }
+}
+
+
+/* get_name retrieves the filename from a directory entry, without the
+   padding, and with a '.' before the extension only if there is one */
+void get_name(char *fullname, struct direntry *dirent)
+{
+    char name[9];
+    char extension[4];
+    int i;
+
+    memcpy(name, dirent->deName, 8);
+    memcpy(extension, dirent->deExtension, 3);
+    name[8] = '\0';
+    extension[3] = '\0';
+    if (((uint8_t)name[0]) == SLOT_E5)
+        name[0] = (char)SLOT_DELETED;
+
+    for (i = 7; i >= 0 && name[i] == ' '; i--)
+        name[i] = '\0';
+    for (i = 2; i >= 0 && extension[i] == ' '; i--)
+        extension[i] = '\0';
+
+    strcpy(fullname, name);
+    if (extension[0] != '\0')
+    {
+        strcat(fullname, ".");
+        strcat(fullname, extension);
+    }
+}
+
+
+/* fat_mtime converts a FAT date and time, which are local time, to a
+   time_t */
+time_t fat_mtime(struct direntry *dirent)
+{
+    uint16_t date = getushort(dirent->deMDate);
+    uint16_t time = getushort(dirent->deMTime);
+    struct tm tm;
+
+    if (date == 0)
+        return 0;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = ((date & DD_YEAR_MASK) >> DD_YEAR_SHIFT) + 80;
+    tm.tm_mon = ((date & DD_MONTH_MASK) >> DD_MONTH_SHIFT) - 1;
+    tm.tm_mday = (date & DD_DAY_MASK) >> DD_DAY_SHIFT;
+    tm.tm_hour = (time & DT_HOURS_MASK) >> DT_HOURS_SHIFT;
+    tm.tm_min = (time & DT_MINUTES_MASK) >> DT_MINUTES_SHIFT;
+    tm.tm_sec = 2 * ((time & DT_2SECONDS_MASK) >> DT_2SECONDS_SHIFT);
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+
+/* list_dir returns the in-use entries of the directory starting at
+   cluster (0 for the root directory), stopping at the first never-used
+   slot.  The caller frees the array */
+struct direntry **list_dir(uint16_t cluster, int *count,
+                           uint8_t *image_buf, struct bpb33 *bpb)
+{
+    int per_cluster = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+    int alloced = 16, n = 0;
+    struct direntry **entries = malloc(alloced * sizeof(struct direntry*));
+    struct chain_walk w;
+    char what[32];
+
+    snprintf(what, sizeof(what), "directory at cluster %u", cluster);
+    chain_walk_init(&w, cluster, image_buf, bpb);
+    while (cluster == MSDOSFSROOT || chain_walk_next(&w, &cluster))
+    {
+        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+        int nslots = cluster == MSDOSFSROOT ? bpb->bpbRootDirEnts : per_cluster;
+        int i;
+
+        for (i = 0; i < nslots; i++, dirent++)
+        {
+            if (dirent->deName[0] == SLOT_EMPTY)
+            {
+                *count = n;
+                return entries;
+            }
+            if (dirent->deName[0] == SLOT_DELETED)
+                continue;
+            if (n == alloced)
+            {
+                alloced *= 2;
+                entries = realloc(entries, alloced * sizeof(struct direntry*));
+            }
+            entries[n++] = dirent;
+        }
+
+        if (cluster == MSDOSFSROOT)
+            break;
+    }
+    chain_walk_check(&w, what);
+
+    *count = n;
+    return entries;
+}
+
+
+/* is_exported returns true for the entries that end up in the
+   archive: regular files and (non-hidden) subdirectories */
+int is_exported(struct direntry *dirent)
+{
+    if (dirent->deName[0] == '.')
+        return FALSE;     // "." and ".."
+    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+        return FALSE;
+    if ((dirent->deAttributes & ATTR_VOLUME) != 0)
+        return FALSE;
+    // don't deal with hidden directories; MacOS makes these
+    // for trash directories and such; just ignore them.
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0 &&
+        (dirent->deAttributes & ATTR_HIDDEN) != 0)
+        return FALSE;
+    return TRUE;
+}
+
+
+/* find_dir returns the first cluster of the directory named by path
+   (0 for the root), or -1 if there's no such directory.  Its entry is
+   stored in *dir (NULL for the root, which has none) */
+int find_dir(char *path, struct direntry **dir, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint16_t cluster = MSDOSFSROOT;
+    char *component = strtok(path, "/\\");
+
+    *dir = NULL;
+    while (component != NULL)
+    {
+        int count, i, found = FALSE;
+        struct direntry **entries = list_dir(cluster, &count, image_buf, bpb);
+
+        for (i = 0; i < count; i++)
+        {
+            char name[MAXFILENAME];
+            if (!is_exported(entries[i]) ||
+                (entries[i]->deAttributes & ATTR_DIRECTORY) == 0)
+                continue;
+            get_name(name, entries[i]);
+            if (strcasecmp(name, component) == 0)
+            {
+                cluster = getushort(entries[i]->deStartCluster);
+                *dir = entries[i];
+                found = TRUE;
+                break;
+            }
+        }
+        free(entries);
+        if (!found)
+            return -1;
+        component = strtok(NULL, "/\\");
+    }
+    return cluster;
+}
+
+
+/* prefetch_file asks the kernel to start reading the first clusters
+   of a file in, so they are resident by the time we get to it */
+void prefetch_file(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint16_t cluster = getushort(dirent->deStartCluster);
+    uint32_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t budget = getulong(dirent->deFileSize);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    struct chain_walk w;
+    uint16_t nclust;
+
+    if (budget > READAHEAD_BYTES)
+        budget = READAHEAD_BYTES;
+
+    /* a looping chain is put_file's problem; here we just stop */
+    chain_walk_init(&w, cluster, image_buf, bpb);
+    while (budget > 0 && chain_walk_extent(&w, &cluster, &nclust))
+    {
+        uint32_t len = nclust * cluster_size;
+        uint8_t *p = cluster_to_addr(cluster, image_buf, bpb);
+        uint8_t *page = (uint8_t*)((uintptr_t)p & ~(uintptr_t)(pagesize - 1));
+
+        if (len > budget)
+            len = budget;
+        madvise(page, len + (p - page), MADV_WILLNEED);
+        budget -= len;
+    }
+}
+
+
+/* put_header fills in and queues a ustar header for path.  Headers
+   come out of a small ring so they stay valid until the batch they
+   are part of has been written */
+void put_header(char *path, char typeflag, int mode, uint32_t size, time_t mtime)
+{
+    static struct ustar_header ring[TAR_IOV_BATCH];
+    static int next = 0;
+    struct ustar_header *h;
+    unsigned int sum = 0;
+    size_t len = strlen(path);
+    uint8_t *b;
+    int i;
+
+    /* the ring has a slot per iovec in a batch, so once it wraps the
+       slot we are about to reuse may still be queued */
+    if (next == 0)
+        flush_out();
+    h = &ring[next];
+    next = (next + 1) % TAR_IOV_BATCH;
+
+    memset(h, 0, sizeof(*h));
+    if (len <= sizeof(h->name))
+        memcpy(h->name, path, len);
+    else
+    {
+        /* split at a '/' so the tail fits in name */
+        char *split = path + len - sizeof(h->name) - 1;
+        while (*split != '\0' && *split != '/')
+            split++;
+        if (*split == '\0' || split - path > (int)sizeof(h->prefix))
+        {
+            fprintf(stderr, "Path %s is too long for a tar header\n", path);
+            exit(1);
+        }
+        memcpy(h->prefix, path, split - path);
+        memcpy(h->name, split + 1, len - (split - path) - 1);
+    }
+
+    snprintf(h->mode, sizeof(h->mode), "%07o", mode);
+    snprintf(h->uid, sizeof(h->uid), "%07o", 0);
+    snprintf(h->gid, sizeof(h->gid), "%07o", 0);
+    snprintf(h->size, sizeof(h->size), "%011o", size);
+    snprintf(h->mtime, sizeof(h->mtime), "%011lo", (unsigned long)mtime);
+    h->typeflag = typeflag;
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+
+    /* the checksum is computed with the checksum field set to spaces */
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (b = (uint8_t*)h, i = 0; i < TAR_BLOCK; i++)
+        sum += b[i];
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+
+    emit(h, TAR_BLOCK);
+}
+
+
+/* put_file queues the header and the data of a regular file.  The data
+   is taken straight from the mapped clusters, a contiguous run at a
+   time */
+void put_file(char *path, struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint16_t cluster = getushort(dirent->deStartCluster);
+    uint32_t size = getulong(dirent->deFileSize);
+    uint32_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t bytes_remaining = size;
+    int mode = (dirent->deAttributes & ATTR_READONLY) ? 0444 : 0644;
+    struct chain_walk w;
+    uint16_t nclust;
+
+    put_header(path, '0', mode, size, fat_mtime(dirent));
+
+    chain_walk_init(&w, cluster, image_buf, bpb);
+    while (bytes_remaining > 0 && chain_walk_extent(&w, &cluster, &nclust))
+    {
+        uint32_t nbytes = nclust * cluster_size;
+
+        if (nbytes > bytes_remaining)
+            nbytes = bytes_remaining;
+        emit(cluster_to_addr(cluster, image_buf, bpb), nbytes);
+        bytes_remaining -= nbytes;
+    }
+    chain_walk_check(&w, path);
+
+    if (bytes_remaining > 0)
+    {
+        /* the header already promised size bytes */
+        fprintf(stderr, "%s: cluster chain ends %u bytes short, padding with zeros\n",
+                path, bytes_remaining);
+        emit_zeros(bytes_remaining);
+    }
+    emit_zeros((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+
+    /* the data we queued lives in the mapping, so the batch only needs
+       flushing when it fills up */
+}
+
+
+/* put_dir archives every entry of the directory starting at cluster,
+   recursing into subdirectories.  path is the archive name of the
+   directory, empty for the top of the archive */
+void put_dir(char *path, uint16_t cluster, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    int count, i, j;
+    struct direntry **entries = list_dir(cluster, &count, image_buf, bpb);
+
+    for (i = 0; i < count; i++)
+    {
+        struct direntry *dirent = entries[i];
+        char name[MAXFILENAME];
+        char child[MAXPATHLEN + 1];
+
+        if (!is_exported(dirent))
+            continue;
+        get_name(name, dirent);
+        if (snprintf(child, sizeof(child), "%s%s%s", path, *path ? "/" : "", name)
+            >= (int)sizeof(child))
+        {
+            fprintf(stderr, "Path %s/%s is too long\n", path, name);
+            exit(1);
+        }
+
+        if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
+        {
+            char dirname[MAXPATHLEN + 2];
+            snprintf(dirname, sizeof(dirname), "%s/", child);
+            put_header(dirname, '5', 0755, 0, fat_mtime(dirent));
+            put_dir(child, getushort(dirent->deStartCluster), image_buf, bpb);
+            continue;
+        }
+
+        if (readahead)
+        {
+            /* start pulling in the next file in this directory while
+               this one is being written */
+            for (j = i + 1; j < count; j++)
+            {
+                if (is_exported(entries[j]) &&
+                    (entries[j]->deAttributes & ATTR_DIRECTORY) == 0)
+                {
+                    prefetch_file(entries[j], image_buf, bpb);
+                    break;
+                }
+            }
+        }
+        put_file(child, dirent, image_buf, bpb);
+    }
+
+    free(entries);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-r] <imagename> [<dirname>]\n", progname);
+    fprintf(stderr, "\twrites a ustar archive of dirname (default: the whole image) to stdout\n");
+    fprintf(stderr, "\t-r: read ahead the next file's clusters while writing the current one\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, c, cluster;
+    struct bpb33* bpb;
+    char path[MAXPATHLEN + 1] = "";
+    char *top;
+    struct direntry *top_dirent;
+
+    while ((c = getopt(argc, argv, "r")) != -1)
+    {
+        switch (c)
+        {
+        case 'r':
+            readahead = TRUE;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2)
+        usage(argv[0]);
+
+    image_buf = mmap_file(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    if (argc - optind == 2)
+        strncpy(path, argv[optind + 1], MAXPATHLEN);
+
+    /* archive names are relative to the top of the image */
+    for (top = path; *top == '/' || *top == '\\'; top++)
+        ;
+    {
+        char lookup[MAXPATHLEN + 1];
+        strcpy(lookup, top);
+        cluster = find_dir(lookup, &top_dirent, image_buf, bpb);
+    }
+    if (cluster < 0)
+    {
+        fprintf(stderr, "No directory called %s exists in the disk image\n", top);
+        exit(1);
+    }
+    while (*top && (top[strlen(top) - 1] == '/' || top[strlen(top) - 1] == '\\'))
+        top[strlen(top) - 1] = '\0';
+
+    if (*top)
+    {
+        char dirname[MAXPATHLEN + 2];
+        snprintf(dirname, sizeof(dirname), "%s/", top);
+        put_header(dirname, '5', 0755, 0, fat_mtime(top_dirent));
+    }
+    put_dir(top, cluster, image_buf, bpb);
+
+    /* end of archive is two zero blocks, padded out to a full record */
+    emit_zeros(2 * TAR_BLOCK);
+    emit_zeros((TAR_RECORD - bytes_out % TAR_RECORD) % TAR_RECORD);
+    flush_out();
+
+    unmmap_file(image_buf, &fd);
+    return 0;
+}
@@ -9,6 +9,8 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -17,371 +19,2352 @@
 #include "dos.h"
 
 
-#define CLUST_ORPHAN        0xfff5     // au:rgavs 5c18     rev.
-#define CLUST_DIR           100
-#define CLUST_HEAD          10
-#define CLUST_NORM          1
-#define TOTAL_CLUST         2880
+/* The check is a fixed number of passes over flat per-cluster arrays,
+   with no recursion:
 
-struct _node{
-    uint16_t stat;                     // or together dir.h ATTR macros ; initially set to CLUST_ORPHAN
-    uint16_t next_clust;               // if in cluster chain, points to next cluster; else -1
-    uint16_t parent;                   //                      points to HEAD of cluster chain; else -1
-}; typedef struct _node node;
+   1. scan_fat reads the whole FAT once, recording each cluster's
+      successor and how many clusters point at it (its in-degree).
+      Each thread takes its own range of clusters.  compare_fats then
+      finds the entries where the other copies of the FAT differ, and
+      pick_fat_copies decides which copy to believe for each.
+   2. check_fat finds chains that run off into free, bad or
+      impossible clusters, from those arrays alone.
+   3. measure_chains works out the length of the chain from every
+      cluster, breaking any loops it finds on the way.
+   4. walk_tree collects every entry in the directory tree, with the
+      threads sharing a queue of directories to read.  check_tree then
+      sorts them by path and checks each against the chain it points
+      at, marking what it reaches and noting where it runs into a
+      chain an earlier entry reached.
+   5. resolve_xlinks reports each of those cross-links, with every
+      entry involved, and gives all but the first a copy of its own.
+   6. find_lost collects the chains nothing reached, and save_lost
+      gives each an entry in a new FOUND.nnn directory.
 
-node *clust_map[2880];                  // end commit
+   With -s (or -S), surface_scan also reads every cluster in use (or
+   every cluster) after the first pass, and place_bad_clusters deals
+   with any that couldn't be read once the tree says who has them.
+
+   Each pass touches each cluster a bounded number of times, so the
+   whole check is linear in the size of the volume.  So is the memory
+   it needs: 13 bytes a cluster for the cluster map, which FAT12's
+   limit of 4084 clusters keeps under 54K, a tree_entry and its path
+   for each directory entry, and a plan_op for each change a repair
+   makes.  The last two hold only as much path as they have.
+
+   Repairs are made to the cluster map as they're decided on, so later
+   passes see the FAT as it will be.  The image itself isn't touched
+   while it's being checked: each change a repair needs goes into a
+   plan, which is applied at the end in one sweep through the image
+   (see apply_plan).  -p writes the plan out as JSON instead, for
+   someone to look over before it's applied with -a; -n makes none.
+   With -c, a checkpoint of what a check found is kept, along with a
+   CRC32C of every sector of each copy of the FAT and of every
+   directory cluster.  Next time, if none of those has changed the
+   volume's metadata is exactly what was checked, so the findings are
+   reported from the checkpoint without running any of the passes (see
+   load_checkpoint).  Otherwise, or if the checkpoint is for some other
+   volume, the whole check runs and a new checkpoint is saved.
+
+   The report is a line for each problem and one of totals, or with -J
+   the same as JSON objects, one to a line.  -P sends a JSON record of
+   how far the check has got to another file descriptor as it goes
+   (see progress_update).  scandisk exits with 0 if it found nothing
+   wrong, 2 if it fixed everything it found and 3 if anything is left.
+
+   Everything that decides or repairs anything runs on one thread,
+   in an order that doesn't depend on how the parallel parts were
+   scheduled, so -j never changes the findings. */
+
+/* what the FAT says about a cluster: the low bits of its state byte */
+#define ST_FREE             0          // free
+#define ST_NEXT             1          // in use, and points to another cluster
+#define ST_EOF              2          // in use, and the last in its chain
+#define ST_BAD              3          // marked bad
+#define ST_BROKEN           4          // in use, but points somewhere impossible
+#define ST_CLASS            0x07
+
+/* what we've found out about it since: the high bits */
+#define ST_SHARED           0x08       // more than one directory entry starts here
+#define ST_HEAD             0x10       // a directory entry starts here
+#define ST_REACHED          0x20       // on the chain of some file or directory
+#define ST_LOST             0x40       // on a chain no file has
+#define ST_WALKED           0x80       // directory claimed by a walker thread
+
+/* rlen of a cluster while it's on measure_chains' stack */
+#define RLEN_BUSY           0xffff
+#define RLEN_MAX            0xfffe
+
+/* what we know about each cluster, as parallel arrays indexed by
+   cluster number.  They are sized from the BPB's cluster count and
+   carved out of one allocation */
+struct clust_map {
+    uint32_t nclusters;
+    uint32_t *owner;                   // tree entry (from 1) that reached it first
+    uint16_t *next;                    // the cluster's FAT entry
+    uint16_t *indeg;                   // how many in-use clusters point here
+    uint16_t *rlen;                    // clusters from here to the end of the chain
+    uint16_t *stack;                   // scratch for measure_chains
+    uint8_t *stat;                     // ST_ class and flags
+};
+
+/* where a chain ran into one an earlier tree entry had already
+   reached.  From there on the two are the same chain, so one of these
+   per entry is all it takes to find every owner of every cluster;
+   clusters with a single owner need nothing beyond clust_map.owner */
+struct xlink {
+    uint16_t cluster;                  // the first cluster they share
+    uint16_t prev;                     // the joining chain's cluster before it, or 0
+    uint32_t depth;                    // how many clusters the joining chain had before it
+    uint32_t owner;                    // the tree entry that joined
+};
+
+/* kinds of problem, in the order they're reported for a cluster */
+#define BAD_START           0          // entry starts at a cluster that isn't in use
+#define SHARED_START        1          // entry starts inside some other chain
+#define CROSS_LINK          2          // more than one cluster points here
+#define CYCLE               3          // the chain loops back on itself
+#define BAD_POINTER         4          // FAT entry isn't a cluster or an end marker
+#define INTO_FREE           5          // chain runs into a free cluster
+#define INTO_BAD            6          // chain runs into a bad cluster
+#define SIZE_LONG           7          // chain is longer than the size says
+#define SIZE_SHORT          8          // chain is shorter than the size says
+#define DIR_LOOP            9          // directory is already in the tree
+#define LOST_CHAIN          10         // in use, but no file has it
+#define FAT_MISMATCH        11         // the copies of the FAT disagree
+#define UNREADABLE          12         // reading it from the image failed
+
+static const char *kind_text[] = {
+    "starts at a cluster that isn't in use",
+    "starts inside another chain",
+    "is cross-linked",
+    "closes a loop in the FAT",
+    "has an impossible FAT entry",
+    "runs into a free cluster",
+    "runs into a bad cluster",
+    "has more clusters than its size needs",
+    "has fewer clusters than its size needs",
+    "is already somewhere else in the tree",
+    "starts a lost chain",
+    "differs between the copies of the FAT",
+    "can't be read",
+};
+
+/* what a finding's count is a count of */
+static const char *kind_unit[] = {
+    NULL, "cluster", "cluster", "cluster", NULL, NULL, NULL,
+    "cluster", "cluster", NULL, "cluster", NULL, NULL,
+};
+
+/* what -J calls each kind */
+static const char *kind_name[] = {
+    "bad_start", "shared_start", "cross_link", "cycle", "bad_pointer",
+    "into_free", "into_bad", "size_long", "size_short", "dir_loop",
+    "lost_chain", "fat_mismatch", "unreadable",
+};
+
+/* and how bad it is: an error can cost some file its data, and a
+   warning only wastes space or redundancy */
+static const char *kind_severity[] = {
+    "error", "error", "error", "error", "error", "error", "error",
+    "warning", "error", "error", "warning", "warning", "error",
+};
+
+/* what scandisk exits with.  1 is still that it couldn't check at all:
+   bad arguments, or an image it couldn't read or write */
+#define EXIT_CLEAN          0          // nothing wrong
+#define EXIT_REPAIRED       2          // every problem fixed (with -p, planned)
+#define EXIT_UNREPAIRED     3          // some problem is still there
+
+struct finding {
+    int kind;
+    uint16_t cluster;                  // where the problem is
+    uint32_t count;
+    int repaired;
+    char path[MAXPATHLEN + 1];         // the file it belongs to, if any
+};
+
+/* kinds of change in a repair plan */
+#define OP_FAT              0          // set a FAT entry
+#define OP_FREE             1          // free a cluster
+#define OP_START            2          // set a directory entry's start cluster
+#define OP_SIZE             3          // set a directory entry's size
+#define OP_DIRENT           4          // write a new directory entry
+#define OP_CLEAR            5          // end a directory at this slot
+#define OP_COPY             6          // copy a cluster's data to another cluster
+#define OP_ZERO             7          // zero a cluster
+#define NOPS                8
+
+static const char *op_name[] = {
+    "fat", "free", "start", "size", "dirent", "clear", "copy", "zero",
+};
+
+struct plan_op {
+    int op;
+    uint32_t offset;                   // where in the image it writes
+    uint32_t seq;                      // the order it was planned in
+    uint16_t cluster;                  // FAT entry, new entry's start, or copy's destination
+    uint32_t value;                    // new FAT entry, start or size, or copy's source
+    uint8_t attr;                      // a new entry's attributes
+    char name[MAXFILENAME];            // a new entry's name
+    char *path;                        // the file it's for, for whoever reads the plan, or NULL
+};
+
+/* a chain find_lost found, for save_lost */
+struct lost {
+    uint16_t start;
+    uint32_t len;
+};
+
+/* a checkpoint file is one of these, then a CRC for each sector of the
+   FAT, a ckpt_dir for each directory cluster, and the findings */
+#define CKPT_MAGIC          "SCANCKP1"
+
+struct checkpoint {
+    char magic[8];
+    uint32_t boot_crc;                 // of the boot sector, so it's the same volume
+    uint32_t root_crc;                 // of the root directory
+    uint32_t nblocks;                  // sectors in all the copies of the FAT
+    uint32_t ndirs;                    // directory clusters
+    uint32_t nfindings;
+    int repair;                        // whether the findings are what repairing left
+};
+
+struct ckpt_dir {
+    uint32_t cluster;
+    uint32_t crc;
+};
+
+/* an entry that isn't the same in every copy of the FAT */
+#define MAXFATS             4          // copies compared; any more just get rewritten
+
+struct fat_diff {
+    uint16_t cluster;
+    uint16_t value[MAXFATS];           // in each copy, FAT 1 first
+    int pick;                          // the copy believed, or -1 if not decided yet
+};
+
+struct clust_map clust_map;
+struct plan_op *plan = NULL;
+int nplan = 0, plan_alloced = 0;
+struct xlink *xlinks = NULL;
+int nxlinks = 0, xlinks_alloced = 0;
+struct lost *lost = NULL;
+int nlost = 0;
+struct fat_diff *diffs = NULL;
+int ndiffs = 0, nfats;
+uint32_t *pick_stamp;
+struct finding *findings = NULL;
+int nfindings = 0, findings_alloced = 0;
+int repair = TRUE;
+int json = FALSE;
+int nthreads = 1;
+char *fixed_word = "fixed";
 uint8_t *image_buf;
+uint32_t image_size;
+int image_fd;
 struct bpb33* bpb;
 
+
+/* clust_map_init allocates the cluster map for the image's geometry */
+void clust_map_init(struct bpb33 *bpb) {
+    uint32_t n = cluster_count(bpb);
+    uint8_t *block = calloc(n, sizeof(uint32_t) + 4 * sizeof(uint16_t) + sizeof(uint8_t));
+
+    if (block == NULL) {
+    	fprintf(stderr, "Out of memory for the cluster map\n");
+    	exit(1);
+    }
+    clust_map.nclusters = n;
+    clust_map.owner = (uint32_t *)block;
+    clust_map.next = (uint16_t *)(clust_map.owner + n);
+    clust_map.indeg = clust_map.next + n;
+    clust_map.rlen = clust_map.indeg + n;
+    clust_map.stack = clust_map.rlen + n;
+    clust_map.stat = (uint8_t *)(clust_map.stack + n);
+}
+
+void clust_map_free() {
+    free(clust_map.owner);
+    memset(&clust_map, 0, sizeof(clust_map));
+}
+
 void usage(char *progname) {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [-n | -p <plan> | -a <plan>] [-c <checkpoint> | -s | -S]\n"
+	    "\t[-J] [-P <fd>] [-j <threads>] <imagename>\n", progname);
+    fprintf(stderr, "\tchecks the disk image and repairs what it can;\n");
+    fprintf(stderr, "\t-n only reports the problems, -p writes the repairs\n");
+    fprintf(stderr, "\tto <plan> without making them, and -a makes the ones\n");
+    fprintf(stderr, "\tin <plan>.  -c skips the check if nothing has changed\n");
+    fprintf(stderr, "\tsince <checkpoint> was saved, and saves it if it runs.\n");
+    fprintf(stderr, "\t-s reads every cluster in use, and -S every cluster,\n");
+    fprintf(stderr, "\tto find any that can't be read.\n");
+    fprintf(stderr, "\t-J reports in JSON, one object to a line, and -P\n");
+    fprintf(stderr, "\twrites progress records to file descriptor <fd>.\n");
+    fprintf(stderr, "\tExits with 0 if the image was clean, 2 if every problem\n");
+    fprintf(stderr, "\twas fixed and 3 if any wasn't.\n");
+    fprintf(stderr, "\tThe FAT and directories are read on <threads> threads\n");
+    fprintf(stderr, "\t(default: one per CPU)\n");
     exit(1);
 }
 
-void print_indent(int indent) {
-    int i;
-    for (i = 0; i < indent*4; i++)
-    	printf(" ");
+
+/* report records a problem.  They're all printed, sorted, at the end */
+void report(int kind, uint16_t cluster, uint32_t count, char *path, int repaired) {
+    struct finding *f;
+
+    if (nfindings == findings_alloced) {
+    	findings_alloced = findings_alloced ? findings_alloced * 2 : 64;
+    	findings = realloc(findings, findings_alloced * sizeof(struct finding));
+    }
+    f = &findings[nfindings++];
+    f->kind = kind;
+    f->cluster = cluster;
+    f->count = count;
+    f->repaired = repaired;
+    strncpy(f->path, path != NULL ? path : "", MAXPATHLEN);
+    f->path[MAXPATHLEN] = '\0';
 }
 
-int follow_clust_chain(struct direntry *dirent, uint16_t cluster, uint32_t bytes_remaining)      // au:rgavs d17d
-{
-    int total_clusters, clust_size;
+int by_cluster(const void *a, const void *b) {
+    const struct finding *fa = a, *fb = b;
 
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-    assert(cluster <= total_clusters);
+    if (fa->cluster != fb->cluster)
+    	return fa->cluster < fb->cluster ? -1 : 1;
+    if (fa->kind != fb->kind)
+    	return fa->kind < fb->kind ? -1 : 1;
+    return strcmp(fa->path, fb->path);
+}
 
-    if (cluster == 0) {
-    	fprintf(stderr, "Bad file termination\n");
-    	return 0;
+/* write_json_string writes s as a JSON string */
+void write_json_string(FILE *f, char *s) {
+    fputc('"', f);
+    for ( ; *s != '\0'; s++) {
+    	uint8_t c = *s;
+    	if (c == '"' || c == '\\')
+    	    fprintf(f, "\\%c", c);
+    	else if (c < 0x20 || c >= 0x7f)
+    	    fprintf(f, "\\u%04x", c);
+    	else
+    	    fputc(c, f);
     }
-    if((int)bytes_remaining < clust_size){                                   // au:rgavs
-        clust_map[cluster]->parent = getushort(dirent->deStartCluster);
-        clust_map[cluster]->stat = (uint16_t) (FAT12_MASK & CLUST_EOFS);
-        if((int)bytes_remaining > clust_size)
-            return 1;
-        else
-            return 2;
+    fputc('"', f);
+}
+
+/* print_findings prints what was found, one line to a problem and a
+   line of totals, and returns what scandisk should exit with.  With -J
+   each line is a JSON object instead.  planned is whether the repairs
+   are only being written to a plan */
+int print_findings(int planned) {
+    int i, fixed = 0, status;
+    const char *result;
+
+    qsort(findings, nfindings, sizeof(struct finding), by_cluster);
+    for (i = 0; i < nfindings; i++) {
+    	struct finding *f = &findings[i];
+    	fixed += f->repaired;
+    	if (json) {
+    	    printf("{\"type\": \"finding\", \"severity\": \"%s\", \"category\": \"%s\", "
+		   "\"path\": ", kind_severity[f->kind], kind_name[f->kind]);
+    	    if (f->path[0] != '\0')
+    		write_json_string(stdout, f->path);
+    	    else
+    		printf("null");
+    	    printf(", \"cluster\": %u", f->cluster);
+    	    if (kind_unit[f->kind] != NULL)
+    		printf(", \"clusters\": %u", f->count);
+    	    printf(", \"status\": \"%s\", \"message\": \"%s\"}\n",
+		   f->repaired ? fixed_word : "unfixed", kind_text[f->kind]);
+    	    continue;
+    	}
+    	if (f->path[0] != '\0')
+    	    printf("%s: ", f->path);
+    	printf("cluster %u %s", f->cluster, kind_text[f->kind]);
+    	if (kind_unit[f->kind] != NULL)
+    	    printf(" (%u %s%s)", f->count, kind_unit[f->kind], f->count == 1 ? "" : "s");
+    	printf("%s%s\n", f->repaired ? " - " : "", f->repaired ? fixed_word : "");
+    }
+
+    if (nfindings == 0) {
+    	status = EXIT_CLEAN;
+    	result = "clean";
+    }
+    else if (fixed == nfindings) {
+    	status = EXIT_REPAIRED;
+    	result = planned ? "planned" : "repaired";
     }
     else {
-    	/* more clusters after this one */
-        clust_map[cluster]->parent = getushort(dirent->deStartCluster);
-        clust_map[cluster]->stat = CLUST_NORM;
-        /* recurse, continuing to copy */
-        int i = 0;
-        if(is_valid_cluster(get_fat_entry(cluster, image_buf, bpb),bpb))
-            i = follow_clust_chain(dirent, get_fat_entry(cluster, image_buf, bpb), bytes_remaining - clust_size);
-        if(i > 2)
-        	clust_map[cluster]->next_clust = i;
-        else if (i == 2)
-            clust_map[cluster]->next_clust = get_fat_entry(cluster, image_buf, bpb);
-        else
-            clust_map[cluster]->next_clust = i;
-        return cluster;
-    }
-    printf("TESTING");
+    	status = EXIT_UNREPAIRED;
+    	result = "unrepaired";
+    }
+    if (json)
+    	printf("{\"type\": \"summary\", \"problems\": %d, \"repaired\": %d, "
+	       "\"result\": \"%s\", \"exit\": %d}\n", nfindings, fixed, result, status);
+    else
+    	printf("%d problem%s found, %d %s\n", nfindings,
+	       nfindings == 1 ? "" : "s", fixed, fixed_word);
+    return status;
+}
+
+
+/* plan_add adds a change that writes at offset in the image to the
+   plan, and returns it for the caller to fill in.  Most changes aren't
+   for any file, so the path is only allocated when there is one */
+struct plan_op *plan_add(int op, uint32_t offset, char *path) {
+    struct plan_op *p;
+
+    if (nplan == plan_alloced) {
+    	plan_alloced = plan_alloced ? plan_alloced * 2 : 64;
+    	plan = realloc(plan, plan_alloced * sizeof(struct plan_op));
+    }
+    p = &plan[nplan];
+    memset(p, 0, sizeof(struct plan_op));
+    p->op = op;
+    p->offset = offset;
+    p->seq = nplan++;
+    if (path != NULL && path[0] != '\0')
+    	p->path = strdup(path);
+    return p;
+}
+
+void plan_free() {
+    int i;
+
+    for (i = 0; i < nplan; i++)
+    	free(plan[i].path);
+    free(plan);
+}
+
+/* fat_entry_offset is where in the image cluster's FAT entry starts
+   (see get_fat_entry); odd entries share a byte with the one before */
+uint32_t fat_entry_offset(uint16_t cluster) {
+    return bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust
+    	+ 3 * (cluster / 2) + (cluster & 1);
+}
+
+void plan_fat(uint16_t cluster, uint16_t value) {
+    struct plan_op *p = plan_add(value == CLUST_FREE ? OP_FREE : OP_FAT,
+    				 fat_entry_offset(cluster), NULL);
+    p->cluster = cluster;
+    p->value = value;
+}
+
+/* plan_field plans a new start cluster (OP_START) or size (OP_SIZE)
+   for dirent */
+void plan_field(int op, struct direntry *dirent, uint32_t value, char *path) {
+    uint8_t *field = op == OP_START ? dirent->deStartCluster : dirent->deFileSize;
+    plan_add(op, field - image_buf, path)->value = value;
+}
+
+void plan_copy(uint16_t to, uint16_t from) {
+    struct plan_op *p = plan_add(OP_COPY, cluster_to_addr(to, image_buf, bpb) - image_buf, NULL);
+    p->cluster = to;
+    p->value = from;
+}
+
+void plan_zero(uint16_t cluster) {
+    plan_add(OP_ZERO, cluster_to_addr(cluster, image_buf, bpb) - image_buf, NULL)->cluster = cluster;
+}
+
+/* plan_dirent plans a new entry at dirent; path is what it'll be
+   called, for the plan */
+void plan_dirent(struct direntry *dirent, char *name, uint8_t attr, uint16_t start,
+		 uint32_t size, char *path) {
+    struct plan_op *p = plan_add(OP_DIRENT, (uint8_t *)dirent - image_buf, path);
+
+    strncpy(p->name, name, MAXFILENAME - 1);
+    p->attr = attr;
+    p->cluster = start;
+    p->value = size;
+}
+
+/* plan_root_dirent plans a new entry in the root directory, in the
+   first slot that's free and not already taken by the plan.  If that
+   was the end of the directory, the slot after it becomes the end.
+   Returns FALSE if the root directory is full */
+int plan_root_dirent(char *name, uint8_t attr, uint16_t start, uint32_t size) {
+    static int slot = 0, past_end = FALSE;
+    struct direntry *root = (struct direntry *)root_dir_addr(image_buf, bpb);
+
+    for ( ; slot < bpb->bpbRootDirEnts && !past_end; slot++)
+    	if (root[slot].deName[0] == SLOT_EMPTY || root[slot].deName[0] == SLOT_DELETED)
+    	    break;
+    if (slot >= bpb->bpbRootDirEnts)
+    	return FALSE;
+
+    plan_dirent(&root[slot], name, attr, start, size, name);
+    if (root[slot].deName[0] == SLOT_EMPTY)
+    	past_end = TRUE;
+    slot++;
+    if (past_end && slot < bpb->bpbRootDirEnts && root[slot].deName[0] != SLOT_EMPTY)
+    	plan_add(OP_CLEAR, (uint8_t *)&root[slot] - image_buf, NULL);
+    return TRUE;
+}
+
+
+/* classify sets the cluster map's idea of cluster's FAT entry.  The
+   FAT scan calls it from several threads at once, each for its own
+   clusters, so the in-degree count is bumped atomically */
+void classify(uint16_t cluster, uint16_t value) {
+    int class;
+
+    if (value == CLUST_FREE)
+    	class = ST_FREE;
+    else if (value == (FAT12_MASK & CLUST_BAD))
+    	class = ST_BAD;
+    else if (is_end_of_file(value))
+    	class = ST_EOF;
+    else if (is_valid_cluster(value, bpb))
+    	class = ST_NEXT;
+    else
+    	class = ST_BROKEN;
+
+    clust_map.next[cluster] = value;
+    clust_map.stat[cluster] = (clust_map.stat[cluster] & ~ST_CLASS) | class;
+    if (class == ST_NEXT)
+    	__atomic_add_fetch(&clust_map.indeg[value], 1, __ATOMIC_RELAXED);
+}
+
+int in_use(uint16_t cluster) {
+    int class = clust_map.stat[cluster] & ST_CLASS;
+    return class == ST_NEXT || class == ST_EOF || class == ST_BROKEN;
+}
+
+/* set_next changes cluster's FAT entry to value.  The cluster map
+   always follows; the change only goes into the plan if we're
+   repairing */
+void set_next(uint16_t cluster, uint16_t value) {
+    if ((clust_map.stat[cluster] & ST_CLASS) == ST_NEXT)
+    	clust_map.indeg[clust_map.next[cluster]]--;
+    classify(cluster, value);
+    if (repair)
+    	plan_fat(cluster, value);
+}
+
+/* release frees the chain from cluster, up to the first cluster that
+   something else still points at or a directory entry starts at.
+   Returns the number freed */
+uint32_t release(uint16_t cluster) {
+    uint32_t freed = 0;
+
+    while (is_valid_cluster(cluster, bpb) && in_use(cluster)
+	   && clust_map.indeg[cluster] == 0 && (clust_map.stat[cluster] & ST_HEAD) == 0
+	   && freed < clust_map.nclusters) {
+    	uint16_t next = clust_map.next[cluster];
+    	int more = (clust_map.stat[cluster] & ST_CLASS) == ST_NEXT;
+
+    	set_next(cluster, CLUST_FREE);
+    	freed++;
+    	if (!more)
+    	    break;
+    	cluster = next;
+    }
+    return freed;
+}
+
+
+/* run_threads runs fn on nthreads threads, passing each its number,
+   and waits for them all */
+void run_threads(void *(*fn)(void *)) {
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    long i;
+
+    for (i = 0; i < nthreads; i++)
+    	if (pthread_create(&threads[i], NULL, fn, (void *)i) != 0) {
+    	    fprintf(stderr, "Can't start a worker thread\n");
+    	    exit(1);
+    	}
+    for (i = 0; i < nthreads; i++)
+    	pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+/* Progress records go to the file descriptor given with -P, one JSON
+   object to a line, so whatever started the check can follow it
+   without reading the report.  Each says which pass is running, how
+   many of its clusters it has been through, at what rate, and how
+   long it should take yet.  Every pass sends one when it's done, and
+   one every PROGRESS_INTERVAL seconds while it runs.  The passes that
+   go through every cluster only look at the clock once every
+   PROGRESS_EVERY clusters, so following them costs next to nothing */
+#define PROGRESS_INTERVAL   0.5
+#define PROGRESS_EVERY      1024
+
+struct progress {
+    FILE *f;
+    pthread_mutex_t lock;
+    const char *pass;
+    int step, nsteps;
+    uint32_t total;                    // clusters the pass goes through
+    uint32_t done;                     // clusters through so far, for progress_add
+    double start;                      // when the pass started
+    double last;                       // when the last record was sent
+};
+
+struct progress progress = { NULL, PTHREAD_MUTEX_INITIALIZER };
+
+double seconds_now() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void progress_begin(const char *pass, int step, uint32_t total) {
+    progress.pass = pass;
+    progress.step = step;
+    progress.total = total;
+    progress.done = 0;
+    progress.start = progress.last = seconds_now();
+}
+
+/* progress_grow adds n clusters to the pass's total, for a pass that
+   only finds out how far it has to go as it goes */
+void progress_grow(uint32_t n) {
+    pthread_mutex_lock(&progress.lock);
+    progress.total += n;
+    pthread_mutex_unlock(&progress.lock);
+}
+
+/* progress_update sends a record that done of the pass's clusters are
+   through, if the pass is over or it's been long enough since the last
+   one.  Any thread can call it */
+void progress_update(uint32_t done, int over) {
+    double t, secs, rate;
+
+    if (progress.f == NULL)
+    	return;
+    pthread_mutex_lock(&progress.lock);
+    t = seconds_now();
+    if (over || t - progress.last >= PROGRESS_INTERVAL) {
+    	secs = t - progress.start;
+    	rate = secs > 0 ? done / secs : 0;
+    	fprintf(progress.f, "{\"type\": \"progress\", \"pass\": \"%s\", \"step\": %d, "
+    		"\"steps\": %d, \"done\": %u, \"total\": %u, \"elapsed\": %.3f, "
+    		"\"clusters_per_sec\": %.0f, \"eta\": ", progress.pass, progress.step,
+    		progress.nsteps, done, progress.total, secs, rate);
+    	if (done >= progress.total)
+    	    fprintf(progress.f, "0}\n");
+    	else if (rate > 0)
+    	    fprintf(progress.f, "%.3f}\n", (progress.total - done) / rate);
+    	else
+    	    fprintf(progress.f, "null}\n");
+    	fflush(progress.f);
+    	progress.last = t;
+    }
+    pthread_mutex_unlock(&progress.lock);
+}
+
+/* progress_add counts n more clusters through, for a pass that runs
+   on several threads at once */
+void progress_add(uint32_t n) {
+    progress_update(__atomic_add_fetch(&progress.done, n, __ATOMIC_RELAXED), FALSE);
+}
+
+/* pass 1: read every FAT entry once, each thread taking an equal
+   share of the clusters */
+void *scan_fat_range(void *arg) {
+    long me = (long)arg;
+    uint32_t span = clust_map.nclusters - CLUST_FIRST;
+    uint32_t c = CLUST_FIRST + span * me / nthreads;
+    uint32_t end = CLUST_FIRST + span * (me + 1) / nthreads;
+
+    uint32_t n = 0;
+
+    for (; c < end; c++) {
+    	classify(c, get_fat_entry(c, image_buf, bpb));
+    	if (++n == PROGRESS_EVERY) {
+    	    progress_add(n);
+    	    n = 0;
+    	}
+    }
+    return NULL;
+}
+
+void scan_fat() {
+    run_threads(scan_fat_range);
+}
+
+/* pass 1a: compare the other copies of the FAT with FAT 1, 64 bytes
+   at a time.  Only a block that differs is decoded into entries, so
+   when the copies agree this costs one memcmp's worth of the FAT */
+#define FAT_BLOCK           64
+
+void compare_fats() {
+    uint32_t fat_size = bpb->bpbFATsecs * bpb->bpbBytesPerSec;
+    uint8_t *fat1 = image_buf + fat_entry_offset(0);
+    uint32_t b, c, last = 0;
+    int alloced = 0, k;
+
+    nfats = bpb->bpbFATs < MAXFATS ? bpb->bpbFATs : MAXFATS;
+    for (b = 0; b < fat_size; b += FAT_BLOCK) {
+    	uint32_t len = fat_size - b < FAT_BLOCK ? fat_size - b : FAT_BLOCK;
+
+    	for (k = 1; k < nfats; k++)
+    	    if (memcmp(fat1 + b, fat1 + k * fat_size + b, len) != 0)
+    		break;
+    	if (k == nfats)
+    	    continue;
+
+    	/* every entry with a byte in the block */
+    	for (c = b * 2 / 3; c <= (b + len) * 2 / 3 && c < clust_map.nclusters; c++) {
+    	    struct fat_diff d;
+    	    int differs = FALSE;
+
+    	    if (c < CLUST_FIRST || c <= last)
+    		continue;
+    	    d.cluster = c;
+    	    d.pick = -1;
+    	    for (k = 0; k < nfats; k++) {
+    		d.value[k] = get_fat_entry(c, image_buf + k * fat_size, bpb);
+    		differs |= d.value[k] != d.value[0];
+    	    }
+    	    if (!differs)
+    		continue;
+    	    if (ndiffs == alloced) {
+    		alloced = alloced ? alloced * 2 : 16;
+    		diffs = realloc(diffs, alloced * sizeof(struct fat_diff));
+    	    }
+    	    diffs[ndiffs++] = d;
+    	    last = c;
+    	}
+    }
+}
+
+int by_diff_cluster(const void *key, const void *d) {
+    return (int)*(const uint16_t *)key - ((const struct fat_diff *)d)->cluster;
+}
+
+/* pick_copy decides which copy to believe about d's cluster, which is
+   on a chain in the directory tree.  end says whether the chain should
+   end there (1), go on (0), or might do either (-1, for a directory,
+   whose size doesn't say).  A copy that carries on into a cluster
+   something else already points at would cross-link two chains, so
+   it's only taken if nothing better is on offer */
+int pick_copy(struct fat_diff *d, int end) {
+    int k, shared = -1;
+
+    for (k = 0; k < nfats; k++) {
+    	uint16_t v = d->value[k];
+    	if (end != 0 && is_end_of_file(v))
+    	    return k;
+    	if (end != 1 && is_valid_cluster(v, bpb)) {
+    	    uint32_t others = clust_map.indeg[v] - (clust_map.next[d->cluster] == v
+    						    && in_use(d->cluster));
+    	    if (others == 0)
+    		return k;
+    	    if (shared < 0)
+    		shared = k;
+    	}
+    }
+    if (shared >= 0)
+    	return shared;
+    for (k = 0; k < nfats; k++)
+    	if (d->value[k] != CLUST_FREE && d->value[k] != (FAT12_MASK & CLUST_BAD))
+    	    return k;
     return 0;
-}       // end d17d
+}
 
+/* pick_chain follows the chain from start the way the copies picked so
+   far have it, picking for each differing entry it comes to.  need is
+   the number of clusters the entry's size calls for, or -1 for a
+   directory.  The clusters go in out, if it isn't NULL; returns how
+   many there were */
+uint32_t pick_chain(uint16_t start, long need, uint16_t *out) {
+    static uint32_t walk = 0;
+    uint16_t c = start;
+    uint32_t n = 0;
 
-/* Check if an existing file increases (or decreases) in size by at least one block.
-Print out a list of files whose length in the directory entry is inconsistent with their length in data blocks (clusters).
-Free any clusters that are beyond the end of a file, but to which the FAT chain still points.
-Adjust the size entry for a file if there is a free or bad cluster in the FAT chain. */
-void size_check(struct direntry *dirent, uint8_t *imgbuf, struct bpb33* bpb){
-	uint16_t cluster = getushort(dirent->deStartCluster);
-	uint32_t file_size = getulong(dirent->deFileSize);
-	uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
-	uint32_t totalcluster = 0;
-    printf("file_size: %u\n", file_size);
-    printf("cluster_size: %u\n", cluster_size);
-	while (is_valid_cluster(cluster, bpb)){
-    	totalcluster += 1;
+    walk++;
+    while (is_valid_cluster(c, bpb) && pick_stamp[c] != walk) {
+    	struct fat_diff *d = bsearch(&c, diffs, ndiffs, sizeof(struct fat_diff),
+    				     by_diff_cluster);
+    	uint16_t next = clust_map.next[c];
 
-    	cluster = get_fat_entry(cluster, image_buf, bpb);
+    	pick_stamp[c] = walk;
+    	if (out != NULL)
+    	    out[n] = c;
+    	n++;
+    	if (d != NULL) {
+    	    if (d->pick < 0)
+    		d->pick = pick_copy(d, need < 0 ? -1 : (long)n >= need);
+    	    next = d->value[d->pick];
+    	}
+    	c = next;
     }
-    	if (file_size%512 == 0) {
-			file_size = file_size/512;
-		}
-		else {
-			file_size = (file_size/512) + 1;
-		}
-		printf("file_size: %u\n", file_size);
-        printf("total cluster: %u\n", totalcluster);
-    	if (file_size > totalcluster){
-    		file_size = totalcluster * bpb->bpbBytesPerSec;
-    		putulong(dirent->deFileSize, file_size);
-    		printf("File size is to big for %s\n", dirent->deName);
+    return n;
+}
+
+/* pick_dir follows the chain of every file in nslots entries at
+   dirent, and adds the subdirectories not seen yet to dirs.  Returns
+   FALSE at the end of the directory */
+int pick_dir(struct direntry *dirent, int nslots, uint16_t *dirs, int *ndirs,
+	     uint8_t *seen) {
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    int i;
+
+    for (i = 0; i < nslots; i++, dirent++) {
+    	uint16_t start = getushort(dirent->deStartCluster);
+
+    	if (dirent->deName[0] == SLOT_EMPTY)
+    	    return FALSE;
+    	if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+    	    || (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+    	    || (dirent->deAttributes & ATTR_VOLUME) != 0)
+    	    continue;
+    	if ((dirent->deAttributes & ATTR_DIRECTORY) == 0)
+    	    pick_chain(start, (getulong(dirent->deFileSize) + clust_size - 1) / clust_size,
+    		       NULL);
+    	else if (is_valid_cluster(start, bpb) && !seen[start]) {
+    	    seen[start] = TRUE;
+    	    dirs[(*ndirs)++] = start;
     	}
-    	if (file_size < totalcluster){
-    		file_size = totalcluster * bpb->bpbBytesPerSec;
-    		putulong(dirent->deFileSize, file_size);
-    		printf("File size is to small for %s\n", dirent->deName);
+    }
+    return TRUE;
+}
+
+/* pass 1b: settle each entry the copies disagree on.  The directory
+   tree is read the way the copies picked so far have it, and where a
+   chain in it comes to such an entry, the copy that ends the chain or
+   carries it on, as the entry's size says it should, is believed.  An
+   entry no chain reaches shouldn't be in use, so a copy that says
+   it's free is believed there.  Every copy is then given the value
+   picked; set_fat_entry writes them all */
+void pick_fat_copies() {
+    uint32_t per_cluster = bpb->bpbBytesPerSec * bpb->bpbSecPerClust
+    	/ sizeof(struct direntry);
+    uint16_t *dirs, *chain;
+    uint8_t *seen;
+    int ndirs = 0, i, k;
+
+    if (ndiffs == 0)
+    	return;
+    pick_stamp = calloc(clust_map.nclusters, sizeof(uint32_t));
+    seen = calloc(clust_map.nclusters, sizeof(uint8_t));
+    dirs = malloc(clust_map.nclusters * sizeof(uint16_t));
+    chain = malloc(clust_map.nclusters * sizeof(uint16_t));
+
+    pick_dir((struct direntry *)root_dir_addr(image_buf, bpb), bpb->bpbRootDirEnts,
+    	     dirs, &ndirs, seen);
+    while (ndirs > 0) {
+    	uint32_t n = pick_chain(dirs[--ndirs], -1, chain), j;
+    	for (j = 0; j < n; j++)
+    	    if (!pick_dir((struct direntry *)cluster_to_addr(chain[j], image_buf, bpb),
+    			  per_cluster, dirs, &ndirs, seen))
+    		break;
+    }
+
+    for (i = 0; i < ndiffs; i++) {
+    	struct fat_diff *d = &diffs[i];
+    	if (d->pick < 0) {
+    	    d->pick = 0;
+    	    for (k = nfats - 1; k >= 0; k--)
+    		if (d->value[k] == CLUST_FREE)
+    		    d->pick = k;
     	}
+    	report(FAT_MISMATCH, d->cluster, 0, NULL, repair);
+    	set_next(d->cluster, d->value[d->pick]);
+    }
 
+    free(pick_stamp);
+    free(seen);
+    free(dirs);
+    free(chain);
 }
 
+/* The surface scan reads clusters with pread rather than through the
+   mapping, so a read error comes back as EIO instead of a SIGBUS.
+   Runs of clusters to read are cut into chunks of SCAN_CHUNK bytes,
+   which the threads take in turn */
+#define SURFACE_NONE        0
+#define SURFACE_USED        1          // -s: the clusters in use
+#define SURFACE_ALL         2          // -S: every cluster
+#define SCAN_CHUNK          (128 * 1024)
 
+struct scan_chunk {
+    uint16_t start;                    // first cluster
+    uint16_t len;                      // clusters
+    uint64_t nsec;                     // how long reading it took
+};
 
+int surface = SURFACE_NONE;
+struct scan_chunk *chunks;
+int nchunks, next_chunk;
+uint8_t *unreadable;
 
-int dirent_sz_correct(struct direntry *dirent) {                        // au:rgavs 5c18
-    clust_map[2]->stat = CLUST_FIRST;
-    return follow_clust_chain(dirent, getushort(dirent->deStartCluster), getulong(dirent->deFileSize));
-}                                                                      // end 5c18
+#ifdef FAULT_INJECT
+/* Test builds only (make CPPFLAGS=-DFAULT_INJECT): $SCANDISK_EIO is a
+   comma-separated list of byte offsets in the image, and any read that
+   covers one of them fails with EIO, as if the disk had a bad sector
+   there */
+uint64_t *faults;
+int nfaults;
 
-/* write the values into a directory entry */
-void write_dirent(struct direntry *dirent, char *filename,
-		  uint16_t start_cluster, uint32_t size)
-{
-    char *p, *p2;
-    char *uppername;
-    int len, i;
+void load_faults() {
+    char *list = getenv("SCANDISK_EIO"), *p;
 
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
+    for (p = list; p != NULL && *p != '\0'; p++) {
+    	faults = realloc(faults, (nfaults + 1) * sizeof(uint64_t));
+    	faults[nfaults++] = strtoull(p, &p, 0);
+    	if (*p != ',')
+    	    break;
+    }
+}
+#endif
+
+ssize_t surface_read(uint8_t *buf, size_t len, off_t offset) {
+#ifdef FAULT_INJECT
+    int i;
+
+    for (i = 0; i < nfaults; i++)
+    	if (faults[i] >= (uint64_t)offset && faults[i] < (uint64_t)offset + len) {
+    	    errno = EIO;
+    	    return -1;
+    	}
+#endif
+    return pread(image_fd, buf, len, offset);
+}
 
-    /* extract just the filename part */
-    uppername = strdup(filename);
-    p2 = uppername;
-    for (i = 0; i < (int)strlen(filename); i++) {
-    	if (p2[i] == '/' || p2[i] == '\\')
-    	    uppername = p2 + i + 1;
+/* surface_worker reads chunks until there are none left.  When a
+   chunk can't be read whole, its clusters are read one at a time to
+   find out which ones are at fault */
+void *surface_worker(void *arg) {
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint8_t *buf = malloc(SCAN_CHUNK);
+    int i;
+
+    (void)arg;
+    while ((i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < nchunks) {
+    	struct scan_chunk *ch = &chunks[i];
+    	off_t offset = cluster_to_addr(ch->start, image_buf, bpb) - image_buf;
+    	size_t len = ch->len * clust_size;
+    	struct timespec t0, t1;
+    	ssize_t got;
+    	uint16_t k;
+
+    	clock_gettime(CLOCK_MONOTONIC, &t0);
+    	got = surface_read(buf, len, offset);
+    	clock_gettime(CLOCK_MONOTONIC, &t1);
+    	ch->nsec = (t1.tv_sec - t0.tv_sec) * 1000000000ull + t1.tv_nsec - t0.tv_nsec;
+    	if (got != (ssize_t)len)
+    	    for (k = 0; k < ch->len; k++)
+    		if (surface_read(buf, clust_size, offset + k * clust_size)
+    		    != (ssize_t)clust_size)
+    		    unreadable[ch->start + k] = TRUE;
+    	progress_add(ch->len);
     }
+    free(buf);
+    return NULL;
+}
 
-    /* convert filename to upper case */
-    for (i = 0; i < (int)strlen(uppername); i++)
-    	uppername[i] = toupper(uppername[i]);
+int by_nsec(const void *a, const void *b) {
+    uint64_t x = ((const struct scan_chunk *)a)->nsec, y = ((const struct scan_chunk *)b)->nsec;
+    return x < y ? -1 : x > y;
+}
 
-    /* set the file name and extension */
-    memset(dirent->deName, ' ', 8);
-    p = strchr(uppername, '.');
-    memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL)
-    	fprintf(stderr, "No filename extension given - defaulting to .___\n");
-    else {
-    	*p = '\0';
-    	p++;
-    	len = strlen(p);
-    	if (len > 3) len = 3;
-        	memcpy(dirent->deExtension, p, len);
+/* pass 1c: read the clusters in use, or all of them, on nthreads
+   threads, and say how fast that went.  Free clusters that can't be
+   read are kept out of the free space map right away, so nothing
+   later picks one to copy into */
+void surface_scan() {
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t per_chunk = SCAN_CHUNK / clust_size, c, nread = 0;
+    struct timespec t0, t1;
+    double secs;
+
+    progress.total = 0;
+    if (surface == SURFACE_NONE)
+    	return;
+#ifdef FAULT_INJECT
+    load_faults();
+#endif
+    unreadable = calloc(clust_map.nclusters, sizeof(uint8_t));
+    chunks = malloc(clust_map.nclusters * sizeof(struct scan_chunk));
+    nchunks = next_chunk = 0;
+    for (c = CLUST_FIRST; c < clust_map.nclusters; c++) {
+    	int class = clust_map.stat[c] & ST_CLASS;
+    	if (class == ST_BAD || (surface == SURFACE_USED && !in_use(c)))
+    	    continue;
+    	if (nchunks > 0 && chunks[nchunks - 1].start + chunks[nchunks - 1].len == c
+    	    && chunks[nchunks - 1].len < per_chunk)
+    	    chunks[nchunks - 1].len++;
+    	else {
+    	    chunks[nchunks].start = c;
+    	    chunks[nchunks++].len = 1;
+    	}
+    	nread++;
     }
+    progress.total = nread;
 
-    if (strlen(uppername)>8)
-        uppername[8]='\0';
-    memcpy(dirent->deName, uppername, strlen(uppername));
-    free(p2);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    run_threads(surface_worker);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
 
-    /* set the attributes and file size */
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
-    putulong(dirent->deFileSize, size);
+    qsort(chunks, nchunks, sizeof(struct scan_chunk), by_nsec);
+    if (json)
+    	printf("{\"type\": \"surface\", \"clusters\": %u, \"bytes\": %llu, "
+	       "\"seconds\": %.3f, \"mb_per_sec\": %.1f, \"reads\": %d", nread,
+	       (unsigned long long)nread * clust_size, secs,
+	       secs > 0 ? nread * (double)clust_size / 1e6 / secs : 0.0, nchunks);
+    else
+    	printf("Surface scan: %u clusters, %.1f MB in %.3f s (%.1f MB/s)", nread,
+	       nread * (double)clust_size / 1e6, secs,
+	       secs > 0 ? nread * (double)clust_size / 1e6 / secs : 0.0);
+    if (nchunks > 0) {
+    	double p50 = chunks[(nchunks - 1) * 50 / 100].nsec / 1e3;
+    	double p90 = chunks[(nchunks - 1) * 90 / 100].nsec / 1e3;
+    	double p99 = chunks[(nchunks - 1) * 99 / 100].nsec / 1e3;
+    	double max = chunks[nchunks - 1].nsec / 1e3;
+    	if (json)
+    	    printf(", \"latency_us\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, "
+		   "\"max\": %.0f}", p50, p90, p99, max);
+    	else
+    	    printf("; %d reads, latency p50 %.0f us, p90 %.0f us, p99 %.0f us, max %.0f us",
+		   nchunks, p50, p90, p99, max);
+    }
+    printf(json ? "}\n" : "\n");
+    free(chunks);
 
-    /* could also set time and date here if we really
-       cared... */
+    for (c = CLUST_FIRST; c < clust_map.nclusters; c++)
+    	if (unreadable[c] && !in_use(c) && repair)
+    	    freemap_reserve(c, image_buf, bpb);
 }
 
 
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
-void create_dirent(struct direntry *dirent, char *filename,
-		   uint16_t start_cluster, uint32_t size)
-{
-    while (1) {
-    	if (dirent->deName[0] == SLOT_EMPTY) {
-    	    /* we found an empty slot at the end of the directory */
-    	    write_dirent(dirent, filename, start_cluster, size);
-    	    dirent++;
+/* pass 2: problems visible in the FAT by itself.  A chain that runs
+   into a free, bad or impossible cluster is ended at its last good
+   cluster */
+void check_fat() {
+    uint32_t c;
+
+    for (c = CLUST_FIRST; c < clust_map.nclusters; c++) {
+    	int class = clust_map.stat[c] & ST_CLASS;
+    	uint16_t next = clust_map.next[c];
+
+    	if (class == ST_BROKEN) {
+    	    report(BAD_POINTER, c, 0, NULL, repair);
+    	    set_next(c, FAT12_MASK & CLUST_EOFS);
+    	}
+    	else if (class == ST_NEXT && !in_use(next)) {
+    	    report((clust_map.stat[next] & ST_CLASS) == ST_BAD ? INTO_BAD : INTO_FREE,
+    		   c, 0, NULL, repair);
+    	    set_next(c, FAT12_MASK & CLUST_EOFS);
+    	}
+    	if ((c + 1 - CLUST_FIRST) % PROGRESS_EVERY == 0)
+    	    progress_update(c + 1 - CLUST_FIRST, FALSE);
+    }
+}
+
+/* pass 3: the length of the chain from every cluster.  Each chain is
+   followed until it ends or reaches a cluster whose length we already
+   know, then the lengths are filled in backwards, so every cluster is
+   pushed once.  Running into a cluster that's still on the stack means
+   a loop, which is broken at the cluster that closes it */
+void measure_chains() {
+    uint16_t *stack = clust_map.stack;
+    uint16_t *rlen = clust_map.rlen;
+    uint32_t c;
+
+    for (c = CLUST_FIRST; c < clust_map.nclusters; c++) {
+    	uint32_t sp = 0, tail = 0;
+    	uint16_t x = c;
+
+    	if ((c + 1 - CLUST_FIRST) % PROGRESS_EVERY == 0)
+    	    progress_update(c + 1 - CLUST_FIRST, FALSE);
+    	if (!in_use(c) || rlen[c] != 0)
+    	    continue;
 
-    	    /* make sure the next dirent is set to be empty, just in
-    	       case it wasn't before */
-    	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-    	    dirent->deName[0] = SLOT_EMPTY;
-    	    return;
+    	while (1) {
+    	    uint16_t y;
+
+    	    stack[sp++] = x;
+    	    rlen[x] = RLEN_BUSY;
+    	    if ((clust_map.stat[x] & ST_CLASS) != ST_NEXT)
+    		break;
+    	    y = clust_map.next[x];
+    	    if (rlen[y] == RLEN_BUSY) {
+    		uint32_t k = sp;
+    		while (stack[--k] != y)
+    		    ;
+    		report(CYCLE, x, sp - k, NULL, repair);
+    		set_next(x, FAT12_MASK & CLUST_EOFS);
+    		break;
+    	    }
+    	    if (rlen[y] != 0) {
+    		tail = rlen[y];
+    		break;
+    	    }
+    	    x = y;
+    	}
+
+    	while (sp > 0) {
+    	    if (tail < RLEN_MAX)
+    		tail++;
+    	    rlen[stack[--sp]] = tail;
     	}
+    }
+}
+
+
+/* cut_chain ends the chain from start after keep clusters, and frees
+   whatever only this chain was using after that.  It won't cut inside
+   a stretch another chain shares; it returns FALSE if it didn't cut */
+int cut_chain(uint16_t start, uint32_t keep) {
+    uint16_t last = start, rest;
+    uint32_t i;
+
+    for (i = 1; i < keep; i++) {
+    	last = clust_map.next[last];
+    	if (clust_map.indeg[last] > 1 || (clust_map.stat[last] & ST_HEAD))
+    	    return FALSE;
+    }
+    rest = clust_map.next[last];
+    set_next(last, FAT12_MASK & CLUST_EOFS);
+    release(rest);
+    return TRUE;
+}
+
+/* mark_chain marks the chain from start as reached by tree entry
+   owner.  If it runs into a cluster an earlier entry reached, the rest
+   is that entry's chain too; where they meet is noted for
+   resolve_xlinks, and we stop */
+void mark_chain(uint16_t start, uint32_t owner) {
+    uint16_t c = start, prev = 0;
+    uint32_t steps = 0;
+
+    while (steps++ < clust_map.nclusters && in_use(c)) {
+    	if (clust_map.owner[c] != 0) {
+    	    if (clust_map.owner[c] != owner) {
+    		if (nxlinks == xlinks_alloced) {
+    		    xlinks_alloced = xlinks_alloced ? xlinks_alloced * 2 : 16;
+    		    xlinks = realloc(xlinks, xlinks_alloced * sizeof(struct xlink));
+    		}
+    		xlinks[nxlinks].cluster = c;
+    		xlinks[nxlinks].prev = prev;
+    		xlinks[nxlinks].depth = steps - 1;
+    		xlinks[nxlinks].owner = owner;
+    		nxlinks++;
+    	    }
+    	    break;
+    	}
+    	clust_map.stat[c] |= ST_REACHED;
+    	clust_map.owner[c] = owner;
+    	if ((clust_map.stat[c] & ST_CLASS) != ST_NEXT)
+    	    break;
+    	prev = c;
+    	c = clust_map.next[c];
+    }
+}
+
+/* check_file compares a file's size with its chain and fixes whichever
+   is wrong: extra clusters are freed, and a chain that's too short has
+   the size cut down to fit.  The size of a file starting inside some
+   other chain isn't checked, as freeing any of it would damage the
+   other one; resolve_xlinks deals with those */
+void check_file(struct direntry *dirent, char *path, uint32_t owner) {
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint16_t start = getushort(dirent->deStartCluster);
+    uint32_t size = getulong(dirent->deFileSize);
+    uint32_t need = (size + clust_size - 1) / clust_size;
+    uint32_t have;
+
+    if (start == 0) {
+    	if (size > 0) {
+    	    report(SIZE_SHORT, 0, need, path, repair);
+    	    if (repair)
+    		plan_field(OP_SIZE, dirent, 0, path);
+    	}
+    	return;
+    }
+    if (!is_valid_cluster(start, bpb) || !in_use(start)) {
+    	report(BAD_START, start, 0, path, repair);
+    	if (repair) {
+    	    plan_field(OP_START, dirent, 0, path);
+    	    plan_field(OP_SIZE, dirent, 0, path);
+    	}
+    	return;
+    }
+    if ((clust_map.stat[start] & ST_SHARED) || clust_map.indeg[start] > 0) {
+    	mark_chain(start, owner);
+    	return;
+    }
+
+    have = clust_map.rlen[start];
+    if (have > need && need > 0) {
+    	int cut = cut_chain(start, need);
+    	report(SIZE_LONG, start, have - need, path, repair && cut);
+    }
+    else if (have > need) {
+    	/* an empty file shouldn't have a chain at all */
+    	report(SIZE_LONG, start, have, path, repair);
+    	if (repair)
+    	    plan_field(OP_START, dirent, 0, path);
+    	clust_map.stat[start] &= ~ST_HEAD;
+    	release(start);
+    	return;
+    }
+    else if (have < need) {
+    	report(SIZE_SHORT, start, need - have, path, repair);
+    	if (repair)
+    	    plan_field(OP_SIZE, dirent, have * clust_size, path);
+    }
+    mark_chain(start, owner);
+}
+
+
+/* a directory waiting to be walked */
+struct pending_dir {
+    uint16_t cluster;
+    char path[MAXPATHLEN + 1];
+};
+
+/* an entry found by walk_tree, for check_tree to look at.  The path
+   is allocated to fit: there can be tens of thousands of these, and
+   most paths are nowhere near MAXPATHLEN */
+struct tree_entry {
+    struct direntry *dirent;
+    int walked;                        // a directory this entry led us into
+    char *path;
+};
+
+/* the directories still to read, shared by the walker threads */
+struct walk_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct pending_dir *dirs;
+    int ndirs, alloced;
+    int busy;                          // threads in the middle of a directory
+    int conflicts;                     // directories two entries led to
+};
 
-    	if (dirent->deName[0] == SLOT_DELETED) {
-    	    /* we found a deleted entry - we can just overwrite it */
-    	    write_dirent(dirent, filename, start_cluster, size);
-    	    return;
+/* what each walker thread found */
+struct walker {
+    struct tree_entry *entries;
+    int nentries, alloced;
+};
+
+struct walk_queue queue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
+struct walker *walkers;
+
+/* every entry in the tree, sorted by path; clust_map.owner and the
+   xlinks refer to them by their place in here, counting from 1 */
+struct tree_entry *tree;
+int ntree;
+
+void queue_push(uint16_t cluster, char *path) {
+    pthread_mutex_lock(&queue.lock);
+    if (queue.ndirs == queue.alloced) {
+    	queue.alloced = queue.alloced ? queue.alloced * 2 : 16;
+    	queue.dirs = realloc(queue.dirs, queue.alloced * sizeof(struct pending_dir));
+    }
+    queue.dirs[queue.ndirs].cluster = cluster;
+    progress_grow(cluster == MSDOSFSROOT ? 1 : clust_map.rlen[cluster]);
+    snprintf(queue.dirs[queue.ndirs].path, MAXPATHLEN + 1, "%.*s/",
+	     MAXPATHLEN - 1, path);
+    queue.ndirs++;
+    pthread_cond_signal(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/* read_dir adds the entries of one directory to w's list, and queues
+   the subdirectories.  A subdirectory is only queued by the first
+   entry to claim it, so a loop in the tree can't be walked forever */
+void read_dir(struct walker *w, struct pending_dir *dir) {
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint16_t cluster = dir->cluster;
+    uint32_t nclust = cluster == MSDOSFSROOT ? 1 : clust_map.rlen[cluster];
+    uint32_t k;
+
+    for (k = 0; k < nclust; k++) {
+    	struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    	int nslots = cluster == MSDOSFSROOT ? bpb->bpbRootDirEnts
+	    : (int)(clust_size / sizeof(struct direntry));
+    	int i;
+
+    	for (i = 0; i < nslots; i++, dirent++) {
+    	    char name[MAXFILENAME], path[MAXPATHLEN + 1];
+    	    struct tree_entry *e;
+    	    uint16_t start;
+
+    	    if (dirent->deName[0] == SLOT_EMPTY)
+    		break;
+    	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+    		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+    		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+    		continue;
+
+    	    if (w->nentries == w->alloced) {
+    		w->alloced = w->alloced ? w->alloced * 2 : 64;
+    		w->entries = realloc(w->entries, w->alloced * sizeof(struct tree_entry));
+    	    }
+    	    e = &w->entries[w->nentries++];
+    	    e->dirent = dirent;
+    	    e->walked = FALSE;
+    	    dirent_name(name, dirent);
+    	    snprintf(path, sizeof(path), "%.*s%s", MAXPATHLEN - MAXFILENAME,
+    		     dir->path, name);
+    	    e->path = strdup(path);
+
+    	    start = getushort(dirent->deStartCluster);
+    	    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0
+    		|| !is_valid_cluster(start, bpb) || !in_use(start))
+    		continue;
+    	    if (__atomic_fetch_or(&clust_map.stat[start], ST_WALKED,
+    				  __ATOMIC_RELAXED) & ST_WALKED) {
+    		__atomic_add_fetch(&queue.conflicts, 1, __ATOMIC_RELAXED);
+    		continue;
+    	    }
+    	    e->walked = TRUE;
+    	    queue_push(start, e->path);
     	}
-    	dirent++;
+    	if (i < nslots || cluster == MSDOSFSROOT)
+    	    break;
+    	cluster = clust_map.next[cluster];
     }
+    progress_add(nclust);
 }
 
+void *walk_worker(void *arg) {
+    struct walker *w = &walkers[(long)arg];
+
+    pthread_mutex_lock(&queue.lock);
+    while (1) {
+    	struct pending_dir dir;
+
+    	while (queue.ndirs == 0 && queue.busy > 0)
+    	    pthread_cond_wait(&queue.ready, &queue.lock);
+    	if (queue.ndirs == 0)
+    	    break;      // nothing queued and nobody left to queue more
+    	dir = queue.dirs[--queue.ndirs];
+    	queue.busy++;
+    	pthread_mutex_unlock(&queue.lock);
+
+    	read_dir(w, &dir);
 
+    	pthread_mutex_lock(&queue.lock);
+    	queue.busy--;
+    }
+    pthread_cond_broadcast(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+    return NULL;
+}
 
-uint16_t print_dirent(struct direntry *dirent, int indent)
-{
-    uint16_t followclust = 0;
+void free_entries(struct tree_entry *entries, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+    	free(entries[i].path);
+    free(entries);
+}
 
+/* walk_tree reads the whole directory tree on nthreads threads.  If
+   two entries led to the same directory, which of them got to walk it
+   depends on timing, so in that (damaged) case it's read again on one
+   thread to get the same answer every time.  Its progress is counted
+   in directory clusters, and the total grows as directories are found */
+void walk_tree() {
+    int threads = nthreads;
+    uint32_t c;
     int i;
-    char name[9];
-    char extension[4];
-    uint32_t size;
-    uint16_t file_cluster;
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
-    if (name[0] == SLOT_EMPTY)
-		return followclust;
-
-    /* skip over deleted entries */
-    if (((uint8_t)name[0]) == SLOT_DELETED)
-		return followclust;
-
-	if (((uint8_t)name[0]) == 0x2E)
-		return followclust;           // skip dot entries "." & ".."
-
-    /* names are space padded - remove the spaces */
-    for (i = 8; i > 0; i--) {
-		if (name[i] == ' ')
-			name[i] = '\0';
-		else
-			break;
-    }
-
-    /* remove the spaces from extensions */
-    for (i = 3; i > 0; i--) {
-		if (extension[i] == ' ')
-			extension[i] = '\0';
-		else
-			break;
-    }
-
-    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN) {
-    	// ignore any long file name extension entries
-    }
-    else if ((dirent->deAttributes & ATTR_VOLUME) != 0)
-		printf("Volume: %s\n", name);
-    else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
-		// don't deal with hidden directories; MacOS makes these
-		// for trash directories and such; just ignore them.
-		if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN) {
-			print_indent(indent);
-			printf("%s/ (directory)\n", name);
-			file_cluster = getushort(dirent->deStartCluster);
-			followclust = file_cluster;
-		}
+
+    progress.total = 0;
+    walkers = calloc(nthreads, sizeof(struct walker));
+    queue_push(MSDOSFSROOT, "");
+    queue.dirs[0].path[0] = '\0';
+    run_threads(walk_worker);
+
+    if (queue.conflicts > 0 && nthreads > 1) {
+    	for (i = 0; i < nthreads; i++)
+    	    free_entries(walkers[i].entries, walkers[i].nentries);
+    	memset(walkers, 0, nthreads * sizeof(struct walker));
+    	for (c = CLUST_FIRST; c < clust_map.nclusters; c++)
+    	    clust_map.stat[c] &= ~ST_WALKED;
+    	queue.conflicts = 0;
+    	progress.total = progress.done = 0;
+    	queue_push(MSDOSFSROOT, "");
+    	queue.dirs[0].path[0] = '\0';
+    	nthreads = 1;
+    	run_threads(walk_worker);
+    	nthreads = threads;
+    }
+}
+
+int by_path(const void *a, const void *b) {
+    return strcmp(((struct tree_entry *)a)->path, ((struct tree_entry *)b)->path);
+}
+
+/* check_tree merges what the walkers found, sorted by path, and checks
+   each entry in turn.  Every start cluster is noted before any chain
+   is cut or freed, so order can't decide what looks shared */
+void check_tree() {
+    struct tree_entry *all;
+    int n = 0, i;
+
+    for (i = 0; i < nthreads; i++)
+    	n += walkers[i].nentries;
+    all = malloc((n + 1) * sizeof(struct tree_entry));
+    n = 0;
+    for (i = 0; i < nthreads; i++) {
+    	memcpy(all + n, walkers[i].entries, walkers[i].nentries * sizeof(struct tree_entry));
+    	n += walkers[i].nentries;
+    	free(walkers[i].entries);
+    }
+    free(walkers);
+    qsort(all, n, sizeof(struct tree_entry), by_path);
+
+    for (i = 0; i < n; i++) {
+    	uint16_t start = getushort(all[i].dirent->deStartCluster);
+    	if (!is_valid_cluster(start, bpb) || !in_use(start))
+    	    continue;
+    	if (clust_map.stat[start] & ST_HEAD)
+    	    clust_map.stat[start] |= ST_SHARED;
+    	clust_map.stat[start] |= ST_HEAD;
+    }
+
+    /* directories go first, so where one shares clusters with a file
+       it's the directory that keeps them */
+    for (i = 0; i < n; i++) {
+    	struct direntry *dirent = all[i].dirent;
+    	uint16_t start = getushort(dirent->deStartCluster);
+
+    	if ((dirent->deAttributes & ATTR_DIRECTORY) == 0)
+    	    continue;
+    	else if (!is_valid_cluster(start, bpb) || !in_use(start)) {
+    	    /* this entry stays, so nothing new may be put where it points */
+    	    report(BAD_START, start, 0, all[i].path, FALSE);
+    	    if (is_valid_cluster(start, bpb) && repair)
+    		freemap_reserve(start, image_buf, bpb);
+    	}
+    	else if (!all[i].walked)
+    	    report(DIR_LOOP, start, 0, all[i].path, FALSE);
+    	else
+    	    mark_chain(start, i + 1);
+    }
+    for (i = 0; i < n; i++)
+    	if ((all[i].dirent->deAttributes & ATTR_DIRECTORY) == 0)
+    	    check_file(all[i].dirent, all[i].path, i + 1);
+    tree = all;
+    ntree = n;
+}
+
+
+int by_junction(const void *a, const void *b) {
+    const struct xlink *xa = a, *xb = b;
+
+    if (xa->cluster != xb->cluster)
+    	return xa->cluster < xb->cluster ? -1 : 1;
+    return xa->owner < xb->owner ? -1 : xa->owner > xb->owner;
+}
+
+/* copy_len is how many of the shared clusters file x->owner needs a
+   copy of: no more than its size calls for */
+uint32_t copy_len(struct xlink *x) {
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t size = getulong(tree[x->owner - 1].dirent->deFileSize);
+    uint32_t need = (size + clust_size - 1) / clust_size;
+
+    if (need <= x->depth)
+    	return 0;
+    if (need - x->depth < clust_map.rlen[x->cluster])
+    	return need - x->depth;
+    return clust_map.rlen[x->cluster];
+}
+
+/* copy_tail gives tree entry x->owner its own copy of the first n
+   clusters from x->cluster on, in clusters taken from the front of
+   runs, and points its chain at the copy instead */
+void copy_tail(struct xlink *x, uint32_t n, struct extent *runs, int *run, uint16_t *used) {
+    uint16_t src = x->cluster, first = 0, last = 0;
+    uint32_t done = 0;
+
+    if (n == 0) {
+    	/* the file ends before the clusters it shares */
+    	if (x->prev != 0)
+    	    set_next(x->prev, FAT12_MASK & CLUST_EOFS);
+    	else
+    	    plan_field(OP_START, tree[x->owner - 1].dirent, 0, tree[x->owner - 1].path);
+    	return;
+    }
+
+    while (done < n) {
+    	uint16_t start = runs[*run].start + *used;
+    	uint16_t len = runs[*run].len - *used;
+    	uint16_t i;
+
+    	if (len > n - done)
+    	    len = n - done;
+    	*used += len;
+    	if (*used == runs[*run].len) {
+    	    (*run)++;
+    	    *used = 0;
+    	}
+
+    	for (i = 0; i < len; i++, done++) {
+    	    uint16_t c = start + i;
+    	    plan_copy(c, src);
+    	    set_next(c, i + 1 < len ? c + 1 : FAT12_MASK & CLUST_EOFS);
+    	    clust_map.stat[c] |= ST_REACHED;
+    	    clust_map.owner[c] = x->owner;
+    	    clust_map.rlen[c] = n - done;
+    	    src = clust_map.next[src];
+    	}
+    	if (last != 0)
+    	    set_next(last, start);
+    	else
+    	    first = start;
+    	last = start + len - 1;
     }
+
+    if (x->prev != 0)
+    	set_next(x->prev, first);
     else {
-        /* a "regular" file entry
-         * print attributes, size, starting cluster, etc. */
-		int ro = (dirent->deAttributes & ATTR_READONLY) == ATTR_READONLY;
-		int hidden = (dirent->deAttributes & ATTR_HIDDEN) == ATTR_HIDDEN;
-		int sys = (dirent->deAttributes & ATTR_SYSTEM) == ATTR_SYSTEM;
-		int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
-        clust_map[followclust]->stat = CLUST_NORM;
-		size = getulong(dirent->deFileSize);
-		print_indent(indent);
-        dirent_sz_correct(dirent);                                          // au:rgavs
-        size_check(dirent, image_buf, bpb);
-
-		printf("%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n",
-			name, extension, size, getushort(dirent->deStartCluster),
-			ro?'r':' ',
-				hidden?'h':' ',
-				sys?'s':' ',
-				arch?'a':' ');
-    }
-    return followclust;
-}
-
-void follow_dir(uint16_t cluster, int indent)
-{
-    while (is_valid_cluster(cluster, bpb) && !(is_end_of_file(cluster))) {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-		for ( ; i < numDirEntries; i++) {
-				uint16_t followclust = print_dirent(dirent, indent);
-				if (followclust){                                       // au:rgavs 5c18
-                    clust_map[followclust]->parent = cluster;
-                    clust_map[cluster]->next_clust = followclust;
-                    clust_map[followclust]->stat = CLUST_DIR;           // end
-					follow_dir(followclust, indent+1);
-                }
-				dirent++;
-		}
-		cluster = get_fat_entry(cluster, image_buf, bpb);
-    }
-}
-
-
-
-void traverse_root()
-{
-    uint16_t cluster = 0;                                               // au:rgavs 5c18
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-    int i = 0;                                                          // end 5c18
-    for ( ; i < bpb->bpbRootDirEnts; i++) {
-        uint16_t followclust = print_dirent(dirent, 0);
-        if (is_valid_cluster(followclust, bpb)){
-            clust_map[followclust]->parent = cluster;       // au:rgavs commit:fcce
-            clust_map[cluster]->next_clust = followclust;   // end      fcce
-            follow_dir(followclust, 1);
-        }
-        dirent++;
-    }
-}
-
-void read_map(){                    // au:rgavs
-    uint16_t start_cluster = -1;
-    int j = 1;
-    u_int32_t size = 0;
-    for(int i = 2; i < 2880; i++){
-        // Good clusters
-        if(clust_map[i]->stat != CLUST_ORPHAN){
-            if(size > 0){;
-                char filename[12];
-                snprintf(filename, 12, "found%d", 42);
-                create_dirent((struct direntry*)cluster_to_addr(0, image_buf, bpb), filename, start_cluster, size);
-                size = 0;
-                j++;
-            }
-            // Free clusters
-            if(get_fat_entry(i, image_buf, bpb) == CLUST_FREE)
-                clust_map[i]->stat = CLUST_FREE;
-            // NORM/Dir clusters
-            else if(clust_map[i]->stat <= CLUST_DIR){
-                if(i%3 == 0)
-                    printf("\n");
-                printf("clust %d->stat = %d     ",i,clust_map[i]->stat);
-            }
-        }
-        // Orphans
-        else {
-            if(size == 0){
-                start_cluster = i;
-            }
-            clust_map[i]->stat = CLUST_ORPHAN & CLUST_HEAD;
-            size += bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-        }
-    }
-    for(int i = 0; i< 2880;i++){
-        free(clust_map[i]);
+    	plan_field(OP_START, tree[x->owner - 1].dirent, first, tree[x->owner - 1].path);
+    	clust_map.stat[first] |= ST_HEAD;
+    }
+}
+
+/* pass 5: every set of entries whose chains run together.  Each entry
+   involved is reported, including the one that reached the shared
+   clusters first.  That one keeps them, and when repairing, every
+   other file gets a private copy of as many of the shared clusters as
+   its size needs, all allocated in one go.  A directory can't be given
+   a copy - that would put everything in it in two places - so a
+   cross-link with a directory on the losing side is only reported */
+void resolve_xlinks() {
+    struct extent *runs = NULL;
+    uint32_t need = 0;
+    uint16_t used = 0;
+    int run = 0, i, j;
+    int copying = FALSE;
+
+    qsort(xlinks, nxlinks, sizeof(struct xlink), by_junction);
+    if (repair) {
+    	for (i = 0; i < nxlinks; i++)
+    	    if ((tree[xlinks[i].owner - 1].dirent->deAttributes & ATTR_DIRECTORY) == 0)
+    		need += copy_len(&xlinks[i]);
+    	if (need == 0 || freemap_alloc_chain(need, &runs, image_buf, bpb) > 0)
+    	    copying = TRUE;
+    	else
+    	    fprintf(stderr, "Not enough free space to copy %u cross-linked clusters\n", need);
+    }
+
+    for (i = 0; i < nxlinks; i = j) {
+    	uint16_t c = xlinks[i].cluster;
+    	uint32_t keeper = clust_map.owner[c];
+    	uint32_t n = clust_map.rlen[c];
+    	int all_fixed = TRUE;
+
+    	for (j = i; j < nxlinks && xlinks[j].cluster == c; j++) {
+    	    struct xlink *x = &xlinks[j];
+    	    int fixed = copying
+    		&& (tree[x->owner - 1].dirent->deAttributes & ATTR_DIRECTORY) == 0;
+
+    	    report(x->prev == 0 ? SHARED_START : CROSS_LINK, c, n,
+    		   tree[x->owner - 1].path, fixed);
+    	    if (fixed)
+    		copy_tail(x, copy_len(x), runs, &run, &used);
+    	    all_fixed &= fixed;
+    	}
+    	report(CROSS_LINK, c, n, tree[keeper - 1].path, all_fixed);
+    }
+    free(runs);
+}
+
+
+/* pass 6: whatever's in use but wasn't reached is lost.  Loops have
+   been broken by now, so each lost chain starts at a cluster nothing
+   points to.  One that runs into a chain a file has is cut off there,
+   leaving the file's clusters to the file.  The chains are kept for
+   save_lost */
+void find_lost() {
+    uint32_t c;
+
+    lost = malloc(clust_map.nclusters * sizeof(struct lost));
+    for (c = CLUST_FIRST; c < clust_map.nclusters; c++) {
+    	uint16_t x = c, last = c;
+    	uint32_t len = 0;
+
+    	if ((c + 1 - CLUST_FIRST) % PROGRESS_EVERY == 0)
+    	    progress_update(c + 1 - CLUST_FIRST, FALSE);
+    	if (!in_use(c) || (clust_map.stat[c] & ST_REACHED)
+    	    || clust_map.indeg[c] > 0)
+    	    continue;
+
+    	while (len < clust_map.nclusters && in_use(x)
+    	       && (clust_map.stat[x] & ST_REACHED) == 0) {
+    	    clust_map.stat[x] |= ST_REACHED | ST_LOST;
+    	    len++;
+    	    last = x;
+    	    if ((clust_map.stat[x] & ST_CLASS) != ST_NEXT)
+    		break;
+    	    x = clust_map.next[x];
+    	}
+    	if ((clust_map.stat[last] & ST_CLASS) == ST_NEXT) {
+    	    uint32_t owner = clust_map.owner[x];
+    	    report(CROSS_LINK, x, clust_map.rlen[x],
+    		   owner != 0 ? tree[owner - 1].path : NULL, repair);
+    	    set_next(last, FAT12_MASK & CLUST_EOFS);
+    	}
+
+    	report(LOST_CHAIN, c, len, NULL, repair);
+    	lost[nlost].start = c;
+    	lost[nlost++].len = len;
+    }
+}
+
+/* relocate moves tree entry owner's cluster c, which can't be read,
+   to a new cluster, zeroed since there's nothing to copy.  Returns
+   FALSE if it can't */
+int relocate(uint16_t c, uint32_t owner) {
+    struct tree_entry *t = &tree[owner - 1];
+    uint16_t x = getushort(t->dirent->deStartCluster), prev = 0;
+    uint32_t steps = 0;
+    struct extent e;
+
+    while (x != c && steps++ < clust_map.nclusters
+    	   && (clust_map.stat[x] & ST_CLASS) == ST_NEXT) {
+    	prev = x;
+    	x = clust_map.next[x];
+    }
+    if (x != c || !freemap_alloc(1, FIT_FIRST, &e, image_buf, bpb))
+    	return FALSE;
+
+    plan_zero(e.start);
+    set_next(e.start, clust_map.next[c]);
+    clust_map.stat[e.start] |= ST_REACHED;
+    clust_map.owner[e.start] = owner;
+    if (prev != 0)
+    	set_next(prev, e.start);
+    else
+    	plan_field(OP_START, t->dirent, e.start, t->path);
+    set_next(c, FAT12_MASK & CLUST_BAD);
+    clust_map.owner[c] = 0;
+    return TRUE;
+}
+
+/* pass 7: what to do about each cluster the surface scan couldn't
+   read.  One in a file is swapped for a new cluster and marked bad, so
+   the file keeps its length and loses only that cluster's data.  A
+   free one is just marked bad.  A directory's can't be swapped without
+   losing the entries in it, and a lost chain's is saved as it is, so
+   those are only reported */
+void place_bad_clusters() {
+    uint32_t c;
+
+    if (unreadable == NULL)
+    	return;
+    for (c = CLUST_FIRST; c < clust_map.nclusters; c++) {
+    	uint32_t owner = clust_map.owner[c];
+
+    	if (!unreadable[c])
+    	    continue;
+    	if (owner != 0 && (tree[owner - 1].dirent->deAttributes & ATTR_DIRECTORY) == 0)
+    	    report(UNREADABLE, c, 0, tree[owner - 1].path, repair && relocate(c, owner));
+    	else if (owner != 0)
+    	    report(UNREADABLE, c, 0, tree[owner - 1].path, FALSE);
+    	else if (in_use(c))
+    	    report(UNREADABLE, c, 0, NULL, FALSE);
+    	else {
+    	    report(UNREADABLE, c, 0, NULL, repair);
+    	    set_next(c, FAT12_MASK & CLUST_BAD);
+    	}
+    }
+    free(unreadable);
+}
+
+/* found_dir_name picks the first FOUND.nnn the root directory doesn't
+   already have */
+int found_dir_name(char *name) {
+    struct direntry *root = (struct direntry *)root_dir_addr(image_buf, bpb);
+    uint8_t taken[1000];
+    int i;
+
+    memset(taken, 0, sizeof(taken));
+    for (i = 0; i < bpb->bpbRootDirEnts && root[i].deName[0] != SLOT_EMPTY; i++)
+    	if (memcmp(root[i].deName, "FOUND   ", 8) == 0 && isdigit(root[i].deExtension[0])
+    	    && isdigit(root[i].deExtension[1]) && isdigit(root[i].deExtension[2])
+    	    && root[i].deName[0] != SLOT_DELETED)
+    	    taken[(root[i].deExtension[0] - '0') * 100 + (root[i].deExtension[1] - '0') * 10
+    		  + root[i].deExtension[2] - '0'] = TRUE;
+    for (i = 0; i < 1000; i++)
+    	if (!taken[i]) {
+    	    sprintf(name, "FOUND.%03d", i);
+    	    return TRUE;
+    	}
+    return FALSE;
+}
+
+/* save_lost puts the chains find_lost found into a new directory,
+   FOUND.nnn, as FILE0000.CHK onwards, each sized to fit its chain.
+   The directory is made big enough for all of them at once, so it
+   costs one entry in the root directory however many there are */
+void save_lost() {
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t per_cluster = clust_size / sizeof(struct direntry);
+    char dirname[MAXFILENAME], path[MAXPATHLEN + 1];
+    struct extent *runs;
+    int nruns, i;
+    uint16_t c, prev = 0, start;
+
+    if (nlost == 0 || !repair)
+    	return;
+
+    nruns = freemap_alloc_chain((nlost + 2 + per_cluster - 1) / per_cluster, &runs,
+    				image_buf, bpb);
+    if (nruns == 0 || !found_dir_name(dirname)
+    	|| !plan_root_dirent(dirname, ATTR_DIRECTORY, runs[0].start, 0)) {
+    	fprintf(stderr, "No room to save the lost chains\n");
+    	for (i = 0; i < nfindings; i++)
+    	    if (findings[i].kind == LOST_CHAIN)
+    		findings[i].repaired = FALSE;
+    	free(runs);
+    	return;
+    }
+
+    /* the directory's chain, cleared out */
+    for (i = 0; i < nruns; i++)
+    	for (c = runs[i].start; c < runs[i].start + runs[i].len; c++) {
+    	    if (prev != 0)
+    		set_next(prev, c);
+    	    plan_zero(c);
+    	    prev = c;
+    	}
+    set_next(prev, FAT12_MASK & CLUST_EOFS);
+
+    /* and its entries, "." and ".." first */
+    start = runs[0].start;
+    c = start;
+    for (i = -2; i < nlost; i++) {
+    	struct direntry *slot = (struct direntry *)cluster_to_addr(c, image_buf, bpb)
+    	    + (i + 2) % per_cluster;
+    	if (i == -2)
+    	    plan_dirent(slot, ".", ATTR_DIRECTORY, start, 0, dirname);
+    	else if (i == -1)
+    	    plan_dirent(slot, "..", ATTR_DIRECTORY, 0, 0, dirname);
+    	else {
+    	    char filename[MAXFILENAME];
+    	    snprintf(filename, sizeof(filename), "FILE%04d.CHK", i % 10000);
+    	    snprintf(path, sizeof(path), "%s/%s", dirname, filename);
+    	    plan_dirent(slot, filename, ATTR_NORMAL, lost[i].start,
+    			lost[i].len * clust_size, path);
+    	}
+    	if ((i + 3) % per_cluster == 0)
+    	    c = clust_map.next[c];
+    }
+    free(runs);
+}
+
+
+int by_offset(const void *a, const void *b) {
+    const struct plan_op *pa = a, *pb = b;
+
+    if (pa->offset != pb->offset)
+    	return pa->offset < pb->offset ? -1 : 1;
+    return pa->seq < pb->seq ? -1 : pa->seq > pb->seq;
+}
+
+/* write_entry is write_dirent, except that it also knows how to write
+   the "." and ".." entries a new directory starts with */
+void write_entry(struct direntry *dirent, char *name, uint8_t attr, uint16_t start,
+		 uint32_t size) {
+    if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    	write_dirent(dirent, name, attr, start, size);
+    	return;
+    }
+    memset(dirent, 0, sizeof(struct direntry));
+    memset(dirent->deName, ' ', 8);
+    memset(dirent->deExtension, ' ', 3);
+    memcpy(dirent->deName, name, strlen(name));
+    dirent->deAttributes = ATTR_DIRECTORY;
+    putushort(dirent->deStartCluster, start);
+}
+
+/* the parts of the image a plan writes to, each flushed once */
+#define REGION_FAT          0
+#define REGION_ROOT         1
+#define REGION_DATA         2
+
+/* apply_plan makes the planned changes, in the order they come in the
+   image, then flushes each region of the image that changed with a
+   single msync.  Changes to the same place are made in the order they
+   were planned */
+void apply_plan() {
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t root_start = root_dir_addr(image_buf, bpb) - image_buf;
+    uint32_t data_start = cluster_to_addr(CLUST_FIRST, image_buf, bpb) - image_buf;
+    uint32_t lo[3] = { UINT32_MAX, UINT32_MAX, UINT32_MAX }, hi[3] = { 0, 0, 0 };
+    long pagesize = sysconf(_SC_PAGESIZE);
+    int i;
+
+    qsort(plan, nplan, sizeof(struct plan_op), by_offset);
+    for (i = 0; i < nplan; i++) {
+    	struct plan_op *p = &plan[i];
+    	uint8_t *at = image_buf + p->offset;
+    	uint32_t len = sizeof(struct direntry);
+    	int region;
+
+    	switch (p->op) {
+    	case OP_FAT:
+    	case OP_FREE:
+    	    set_fat_entry(p->cluster, p->value, image_buf, bpb);
+    	    len = (bpb->bpbFATs - 1) * bpb->bpbFATsecs * bpb->bpbBytesPerSec + 2;
+    	    break;
+    	case OP_START:
+    	    putushort(at, p->value);
+    	    len = 2;
+    	    break;
+    	case OP_SIZE:
+    	    putulong(at, p->value);
+    	    len = 4;
+    	    break;
+    	case OP_DIRENT:
+    	    write_entry((struct direntry *)at, p->name, p->attr, p->cluster, p->value);
+    	    break;
+    	case OP_CLEAR:
+    	    memset(at, 0, sizeof(struct direntry));
+    	    break;
+    	case OP_COPY:
+    	    memcpy(at, cluster_to_addr(p->value, image_buf, bpb), clust_size);
+    	    len = clust_size;
+    	    break;
+    	case OP_ZERO:
+    	    memset(at, 0, clust_size);
+    	    len = clust_size;
+    	    break;
+    	}
+
+    	region = p->offset < root_start ? REGION_FAT
+    	    : p->offset < data_start ? REGION_ROOT : REGION_DATA;
+    	if (p->offset < lo[region])
+    	    lo[region] = p->offset;
+    	if (p->offset + len > hi[region])
+    	    hi[region] = p->offset + len;
+    }
+
+    for (i = REGION_FAT; i <= REGION_DATA; i++) {
+    	uint32_t from = lo[i] - lo[i] % pagesize;
+    	if (hi[i] > lo[i] && msync(image_buf + from, hi[i] - from, MS_SYNC) < 0) {
+    	    fprintf(stderr, "Can't write the repairs out: %s\n", strerror(errno));
+    	    exit(1);
+    	}
+    }
+}
+
+
+/* write_plan writes the plan to filename as JSON: the CRC32C of the
+   image it was made for, and the changes in the order they'd be made,
+   one to a line */
+void write_plan(char *filename) {
+    FILE *f = fopen(filename, "w");
+    int i;
+
+    if (f == NULL) {
+    	fprintf(stderr, "Can't create %s: %s\n", filename, strerror(errno));
+    	exit(1);
+    }
+    qsort(plan, nplan, sizeof(struct plan_op), by_offset);
+    fprintf(f, "{\n  \"image_crc32c\": \"%08x\",\n  \"ops\": [",
+	    crc32c(0, image_buf, image_size));
+    for (i = 0; i < nplan; i++) {
+    	struct plan_op *p = &plan[i];
+
+    	fprintf(f, "%s\n    {\"op\": \"%s\", \"offset\": %u", i > 0 ? "," : "",
+    		op_name[p->op], p->offset);
+    	switch (p->op) {
+    	case OP_FAT:
+    	case OP_FREE:
+    	    fprintf(f, ", \"cluster\": %u, \"value\": %u", p->cluster, p->value);
+    	    break;
+    	case OP_START:
+    	case OP_SIZE:
+    	    fprintf(f, ", \"value\": %u", p->value);
+    	    break;
+    	case OP_DIRENT:
+    	    fprintf(f, ", \"name\": ");
+    	    write_json_string(f, p->name);
+    	    fprintf(f, ", \"attr\": %u, \"start\": %u, \"size\": %u",
+    		    p->attr, p->cluster, p->value);
+    	    break;
+    	case OP_COPY:
+    	    fprintf(f, ", \"cluster\": %u, \"from\": %u", p->cluster, p->value);
+    	    break;
+    	case OP_ZERO:
+    	    fprintf(f, ", \"cluster\": %u", p->cluster);
+    	    break;
+    	}
+    	if (p->path != NULL) {
+    	    fprintf(f, ", \"path\": ");
+    	    write_json_string(f, p->path);
+    	}
+    	fputc('}', f);
     }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
 }
 
+
+/* A small reader for the plans write_plan writes, not JSON at large:
+   objects whose members are numbers, strings, or (for "ops") an array
+   of objects.  Each returns FALSE on anything it can't make sense of */
+
+void json_space(char **p) {
+    while (isspace((unsigned char)**p))
+    	(*p)++;
+}
+
+int json_char(char **p, char c) {
+    json_space(p);
+    if (**p != c)
+    	return FALSE;
+    (*p)++;
+    return TRUE;
+}
+
+int json_string(char **p, char *out, int max) {
+    int n = 0;
+
+    if (!json_char(p, '"'))
+    	return FALSE;
+    while (**p != '"') {
+    	unsigned int c = (unsigned char)*(*p)++;
+    	if (c == '\0')
+    	    return FALSE;
+    	if (c == '\\') {
+    	    c = (unsigned char)*(*p)++;
+    	    if (c == 'u') {
+    		if (sscanf(*p, "%4x", &c) != 1 || c > 0xff)
+    		    return FALSE;
+    		*p += 4;
+    	    }
+    	    else if (c != '"' && c != '\\' && c != '/')
+    		return FALSE;
+    	}
+    	if (n < max - 1)
+    	    out[n++] = c;
+    }
+    (*p)++;
+    out[n] = '\0';
+    return TRUE;
+}
+
+int json_number(char **p, uint32_t *out) {
+    char *end;
+    unsigned long v;
+
+    json_space(p);
+    if (!isdigit((unsigned char)**p))
+    	return FALSE;
+    v = strtoul(*p, &end, 10);
+    if (v > UINT32_MAX)
+    	return FALSE;
+    *out = v;
+    *p = end;
+    return TRUE;
+}
+
+/* json_op reads one change into the plan */
+int json_op(char **p) {
+    struct plan_op *op = plan_add(NOPS, 0, NULL);
+    char key[16], str[MAXPATHLEN + 1];
+    uint32_t v;
+    int i;
+
+    if (!json_char(p, '{'))
+    	return FALSE;
+    do {
+    	if (!json_string(p, key, sizeof(key)) || !json_char(p, ':'))
+    	    return FALSE;
+    	json_space(p);
+    	if (**p == '"') {
+    	    if (!json_string(p, str, sizeof(str)))
+    		return FALSE;
+    	    if (strcmp(key, "op") == 0) {
+    		for (i = 0; i < NOPS; i++)
+    		    if (strcmp(str, op_name[i]) == 0)
+    			op->op = i;
+    	    }
+    	    else if (strcmp(key, "name") == 0)
+    		strncpy(op->name, str, MAXFILENAME - 1);
+    	    else if (strcmp(key, "path") == 0 && op->path == NULL)
+    		op->path = strdup(str);
+    	    continue;
+    	}
+    	if (!json_number(p, &v))
+    	    return FALSE;
+    	if (strcmp(key, "offset") == 0)
+    	    op->offset = v;
+    	else if (strcmp(key, "cluster") == 0 || strcmp(key, "start") == 0)
+    	    op->cluster = v;
+    	else if (strcmp(key, "value") == 0 || strcmp(key, "size") == 0
+    		 || strcmp(key, "from") == 0)
+    	    op->value = v;
+    	else if (strcmp(key, "attr") == 0)
+    	    op->attr = v;
+    } while (json_char(p, ','));
+    return json_char(p, '}') && op->op != NOPS;
+}
+
+/* check_op makes sure a change read from a plan file writes where it
+   says it does, to somewhere that makes sense for it */
+int check_op(struct plan_op *p) {
+    uint32_t root_start = root_dir_addr(image_buf, bpb) - image_buf;
+    uint32_t data_start = cluster_to_addr(CLUST_FIRST, image_buf, bpb) - image_buf;
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t slot = p->offset;
+
+    switch (p->op) {
+    case OP_FAT:
+    	return is_valid_cluster(p->cluster, bpb) && p->value <= FAT12_MASK
+    	    && p->offset == fat_entry_offset(p->cluster);
+    case OP_FREE:
+    	return is_valid_cluster(p->cluster, bpb) && p->value == CLUST_FREE
+    	    && p->offset == fat_entry_offset(p->cluster);
+    case OP_COPY:
+    	return is_valid_cluster(p->cluster, bpb) && p->value <= FAT12_MASK
+    	    && is_valid_cluster(p->value, bpb)
+    	    && p->offset == (uint32_t)(cluster_to_addr(p->cluster, image_buf, bpb) - image_buf);
+    case OP_ZERO:
+    	return is_valid_cluster(p->cluster, bpb)
+    	    && p->offset == (uint32_t)(cluster_to_addr(p->cluster, image_buf, bpb) - image_buf);
+    case OP_START:
+    	slot -= offsetof(struct direntry, deStartCluster);
+    	if (p->value != 0 && !is_valid_cluster(p->value, bpb))
+    	    return FALSE;
+    	break;
+    case OP_SIZE:
+    	slot -= offsetof(struct direntry, deFileSize);
+    	break;
+    case OP_DIRENT:
+    	if (p->cluster != 0 && !is_valid_cluster(p->cluster, bpb))
+    	    return FALSE;
+    	break;
+    }
+    /* the rest write into a directory entry */
+    if (slot < root_start || slot + sizeof(struct direntry) > image_size)
+    	return FALSE;
+    if (slot < data_start)
+    	return (slot - root_start) % sizeof(struct direntry) == 0;
+    return (slot - data_start) % clust_size % sizeof(struct direntry) == 0;
+}
+
+/* read_plan reads a plan written by write_plan, and checks that it was
+   made for this image as it is now */
+void read_plan(char *filename) {
+    FILE *f = fopen(filename, "r");
+    char key[16], crc[16], skip[MAXPATHLEN + 1];
+    char *buf, *p;
+    struct stat st;
+    uint32_t v;
+    int i;
+
+    if (f == NULL || fstat(fileno(f), &st) < 0) {
+    	fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+    	exit(1);
+    }
+    buf = malloc(st.st_size + 1);
+    buf[fread(buf, 1, st.st_size, f)] = '\0';
+    fclose(f);
+
+    crc[0] = '\0';
+    p = buf;
+    if (!json_char(&p, '{'))
+    	goto bad;
+    do {
+    	if (!json_string(&p, key, sizeof(key)) || !json_char(&p, ':'))
+    	    goto bad;
+    	if (strcmp(key, "ops") == 0) {
+    	    if (!json_char(&p, '['))
+    		goto bad;
+    	    if (json_char(&p, ']'))
+    		continue;
+    	    do {
+    		if (!json_op(&p))
+    		    goto bad;
+    	    } while (json_char(&p, ','));
+    	    if (!json_char(&p, ']'))
+    		goto bad;
+    	}
+    	else if (strcmp(key, "image_crc32c") == 0) {
+    	    if (!json_string(&p, crc, sizeof(crc)))
+    		goto bad;
+    	}
+    	else if (!json_number(&p, &v) && !json_string(&p, skip, sizeof(skip)))
+    	    goto bad;
+    } while (json_char(&p, ','));
+    if (!json_char(&p, '}'))
+    	goto bad;
+    free(buf);
+
+    if (crc[0] == '\0' || strtoul(crc, NULL, 16) != crc32c(0, image_buf, image_size)) {
+    	fprintf(stderr, "The image has changed since %s was made\n", filename);
+    	exit(1);
+    }
+    for (i = 0; i < nplan; i++)
+    	if (!check_op(&plan[i])) {
+    	    fprintf(stderr, "%s: change %d doesn't fit this image\n", filename, i + 1);
+    	    exit(1);
+    	}
+    return;
+
+bad:
+    fprintf(stderr, "%s isn't a repair plan (at byte %ld)\n", filename, (long)(p - buf));
+    exit(1);
+}
+
+
+uint32_t fat_block_crc(uint32_t block) {
+    uint32_t size = bpb->bpbBytesPerSec;
+    return crc32c(0, image_buf + fat_entry_offset(0) + block * size, size);
+}
+
+uint32_t root_crc() {
+    return crc32c(0, root_dir_addr(image_buf, bpb),
+    		  bpb->bpbRootDirEnts * sizeof(struct direntry));
+}
+
+uint32_t cluster_crc(uint16_t cluster) {
+    return crc32c(0, cluster_to_addr(cluster, image_buf, bpb),
+    		  bpb->bpbBytesPerSec * bpb->bpbSecPerClust);
+}
+
+/* load_checkpoint reads the checkpoint in filename and checks it
+   against the image.  If it's for this volume and nothing it covers
+   has changed, the findings it holds are what a check would find, and
+   they become this run's findings; then it returns TRUE.  That costs a
+   CRC of the FAT and of each directory cluster, read straight from
+   where they are, and none of the passes */
+int load_checkpoint(char *filename) {
+    FILE *f = fopen(filename, "r");
+    struct checkpoint ck;
+    uint32_t i, crc, blocks_changed = 0, dirs_changed = 0;
+    struct ckpt_dir d;
+
+    if (f == NULL)
+    	return FALSE;
+    if (fread(&ck, sizeof(ck), 1, f) != 1 || memcmp(ck.magic, CKPT_MAGIC, 8) != 0
+    	|| ck.boot_crc != crc32c(0, image_buf, bpb->bpbBytesPerSec)
+    	|| ck.nblocks != bpb->bpbFATsecs * bpb->bpbFATs) {
+    	fprintf(stderr, "%s isn't a checkpoint for this volume; checking everything\n",
+    		filename);
+    	fclose(f);
+    	return FALSE;
+    }
+
+    for (i = 0; i < ck.nblocks; i++)
+    	if (fread(&crc, sizeof(crc), 1, f) != 1 || crc != fat_block_crc(i))
+    	    blocks_changed++;
+    if (ck.root_crc != root_crc())
+    	dirs_changed++;
+    for (i = 0; i < ck.ndirs; i++)
+    	if (fread(&d, sizeof(d), 1, f) != 1 || !is_valid_cluster(d.cluster, bpb)
+    	    || d.crc != cluster_crc(d.cluster))
+    	    dirs_changed++;
+    if (blocks_changed > 0 || dirs_changed > 0) {
+    	fprintf(stderr, "%u FAT sector%s and %u director%s changed since %s"
+    		" was saved; checking everything\n",
+    		blocks_changed, blocks_changed == 1 ? "" : "s",
+    		dirs_changed, dirs_changed == 1 ? "y cluster has" : "y clusters have",
+    		filename);
+    	fclose(f);
+    	return FALSE;
+    }
+
+    /* findings left by -n may be ones this run is meant to repair */
+    if (ck.nfindings > 0 && !ck.repair && repair) {
+    	fclose(f);
+    	return FALSE;
+    }
+    findings = malloc((ck.nfindings + 1) * sizeof(struct finding));
+    findings_alloced = ck.nfindings + 1;
+    nfindings = fread(findings, sizeof(struct finding), ck.nfindings, f);
+    fclose(f);
+    if (nfindings != (int)ck.nfindings) {
+    	nfindings = 0;
+    	return FALSE;
+    }
+    fprintf(stderr, "Nothing has changed since %s was saved\n", filename);
+    return TRUE;
+}
+
+/* save_checkpoint writes what this run found to filename, with the
+   CRCs that tell whether it still holds.  Only a run that left the
+   image as it found it can vouch for it */
+void save_checkpoint(char *filename) {
+    char tmp[MAXPATHLEN + 8];
+    struct checkpoint ck;
+    struct ckpt_dir d;
+    uint32_t i, crc, c;
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+    	fprintf(stderr, "Can't create %s: %s\n", tmp, strerror(errno));
+    	exit(1);
+    }
+
+    memset(&ck, 0, sizeof(ck));
+    memcpy(ck.magic, CKPT_MAGIC, 8);
+    ck.boot_crc = crc32c(0, image_buf, bpb->bpbBytesPerSec);
+    ck.root_crc = root_crc();
+    ck.nblocks = bpb->bpbFATsecs * bpb->bpbFATs;
+    for (c = CLUST_FIRST; c < clust_map.nclusters; c++)
+    	if (clust_map.owner[c] != 0
+    	    && (tree[clust_map.owner[c] - 1].dirent->deAttributes & ATTR_DIRECTORY))
+    	    ck.ndirs++;
+    ck.nfindings = nfindings;
+    ck.repair = repair;
+    fwrite(&ck, sizeof(ck), 1, f);
+
+    for (i = 0; i < ck.nblocks; i++) {
+    	crc = fat_block_crc(i);
+    	fwrite(&crc, sizeof(crc), 1, f);
+    }
+    for (c = CLUST_FIRST; c < clust_map.nclusters; c++)
+    	if (clust_map.owner[c] != 0
+    	    && (tree[clust_map.owner[c] - 1].dirent->deAttributes & ATTR_DIRECTORY)) {
+    	    d.cluster = c;
+    	    d.crc = cluster_crc(c);
+    	    fwrite(&d, sizeof(d), 1, f);
+    	}
+    fwrite(findings, sizeof(struct finding), nfindings, f);
+
+    if (fclose(f) != 0 || rename(tmp, filename) < 0) {
+    	fprintf(stderr, "Can't save %s: %s\n", filename, strerror(errno));
+    	exit(1);
+    }
+}
+
+
+/* the passes, in the order they run */
+struct pass {
+    const char *name;
+    void (*run)(void);
+};
+
+static struct pass passes[] = {
+    { "scan_fat", scan_fat },
+    { "compare_fats", compare_fats },
+    { "pick_fat_copies", pick_fat_copies },
+    { "surface_scan", surface_scan },
+    { "check_fat", check_fat },
+    { "measure_chains", measure_chains },
+    { "walk_tree", walk_tree },
+    { "check_tree", check_tree },
+    { "resolve_xlinks", resolve_xlinks },
+    { "find_lost", find_lost },
+    { "place_bad_clusters", place_bad_clusters },
+    { "save_lost", save_lost },
+};
+
+#define NPASSES (int)(sizeof(passes) / sizeof(passes[0]))
+
 int main(int argc, char** argv) {
-    for(int i = 0; i < 2880;i++){                                       // au:rgavs 1993
-        clust_map[i] = (node*)malloc(sizeof(node));
-        clust_map[i]->stat = CLUST_ORPHAN;
-        clust_map[i]->parent = -1;
-        clust_map[i]->next_clust = -1;                                  // end 1993
-    }
-    int fd;
-    if (argc < 2)
+    char *plan_file = NULL, *apply_file = NULL, *checkpoint_file = NULL, *end;
+    struct stat st;
+    int fd, c, i, status;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((c = getopt(argc, argv, "nj:p:a:c:sSJP:")) != -1) {
+    	switch (c) {
+    	case 'n':
+    	    repair = FALSE;
+    	    break;
+    	case 'p':
+    	    plan_file = optarg;
+    	    fixed_word = "planned";
+    	    break;
+    	case 'a':
+    	    apply_file = optarg;
+    	    break;
+    	case 'c':
+    	    checkpoint_file = optarg;
+    	    break;
+    	case 's':
+    	    surface = SURFACE_USED;
+    	    break;
+    	case 'S':
+    	    surface = SURFACE_ALL;
+    	    break;
+    	case 'J':
+    	    json = TRUE;
+    	    break;
+    	case 'P':
+    	    fd = strtol(optarg, &end, 10);
+    	    if (*optarg == '\0' || *end != '\0')
+    		usage(argv[0]);
+    	    if ((progress.f = fdopen(fd, "w")) == NULL) {
+    		fprintf(stderr, "Can't write progress to fd %d: %s\n", fd, strerror(errno));
+    		exit(1);
+    	    }
+    	    break;
+    	case 'j':
+    	    nthreads = atoi(optarg);
+    	    if (nthreads < 1)
+    		usage(argv[0]);
+    	    break;
+    	default:
+    	    usage(argv[0]);
+    	}
+    }
+    if (argc - optind != 1 || (apply_file != NULL
+    				 && (plan_file != NULL || checkpoint_file != NULL || !repair))
+    	|| (surface != SURFACE_NONE && (apply_file != NULL || checkpoint_file != NULL)))
     	usage(argv[0]);
+    if (nthreads < 1)
+    	nthreads = 1;
 
-    image_buf = mmap_file(argv[1], &fd);
+    image_buf = mmap_file(argv[optind], &fd);
+    fstat(fd, &st);
+    image_size = st.st_size;
+    image_fd = fd;
     bpb = check_bootsector(image_buf);
 
-    // start user code
-    traverse_root();
-    read_map();
+    if (apply_file != NULL) {
+    	read_plan(apply_file);
+    	apply_plan();
+    	if (json)
+    	    printf("{\"type\": \"applied\", \"changes\": %d}\n", nplan);
+    	else
+    	    printf("%d changes applied\n", nplan);
+    	status = nplan > 0 ? EXIT_REPAIRED : EXIT_CLEAN;
+    	plan_free();
+    	unmmap_file(image_buf, &fd);
+    	return status;
+    }
+
+    if (checkpoint_file != NULL && load_checkpoint(checkpoint_file)) {
+    	status = print_findings(plan_file != NULL);
+    	free(findings);
+    	unmmap_file(image_buf, &fd);
+    	return status;
+    }
+
+    clust_map_init(bpb);
+
+    progress.nsteps = NPASSES;
+    for (i = 0; i < NPASSES; i++) {
+    	progress_begin(passes[i].name, i + 1, clust_map.nclusters - CLUST_FIRST);
+    	passes[i].run();
+    	progress_update(progress.total, TRUE);
+    }
+    status = print_findings(plan_file != NULL);
+    if (plan_file != NULL)
+    	write_plan(plan_file);
+    else if (repair)
+    	apply_plan();
+    if (checkpoint_file != NULL && nplan == 0)
+    	save_checkpoint(checkpoint_file);
+
+    plan_free();
+    free_entries(tree, ntree);
+    free(xlinks);
+    free(lost);
+    free(diffs);
+    clust_map_free();
     unmmap_file(image_buf, &fd);
-    printf("Execution complete.\n");
-    return 0;
+    return status;
 }